@@ -9,12 +9,20 @@
  *  This in turn allows the Vic-20 keyboard to appear as a HID keyboard
  *  to a PC or Mac.
  *
- *  This project consists of four files:
+ *  This project consists of these files:
  *
  *  Vic20_usb_keyboard.c      top-level source (this file)
  *  usb_keyboard.c           PJRC's USB HID keyboard source for Teensy++ 2.0
  *  usb_keyboard.h           PJRC's USB HID keyboard header file (modified)
+ *  timer.c, timer.h         Timer1 scan tick and millisecond/microsecond clock
+ *  debounce.c, debounce.h   per-key debounce of the raw matrix samples
+ *  report.c, report.h       boot and N-key rollover report builder
+ *  config.c, config.h       runtime settings in EEPROM, set over vendor requests
+ *  latency.c, latency.h     edge-to-report latency histogram, a HID feature report
+ *  record.c, record.h       raw key edge recorder, drained over vendor requests
  *  Makefile                 PJRC's makefile for building the project (modified)
+ *  host/                    simulator for building and testing on Linux (make host)
+ *  tools/                   vic20cfg, the Linux client for the settings (make tools)
  *
  *  Heavily cribbed from M100 USB Keyboard project by created by Karl Lunt
  *  (www.seanet.com/~karllunt) and Spaceman Spiff's Commodire 64 USB Keyboard
@@ -67,7 +75,7 @@
  *		   2         CRSR RL    A       D       G       J       L       ;      CTRL
  *		   3            F7      4       6       8       0       -    CLR/HOME   2
  *		   4            F1      Z       C       B       M       .    R shift   SPC
- *		   5            F3      S       F       H       K       :       =       C=
+ *		   5            F3      S       F       H       K       :       =    C= (Fn)
  *		   6            F5      E       T       U       O       @       ^       Q
  *		   7         CRSR DU  L shift   X       V       N       ,       /    RUN/STOP
  *  
@@ -109,7 +117,13 @@
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <util/delay_basic.h>
 #include "usb_keyboard.h"
+#include "timer.h"
+#include "debounce.h"
+#include "report.h"
+#include "config.h"
+#include "record.h"
 
 
 #ifndef  FALSE
@@ -157,6 +171,88 @@
 #define CPU_PRESCALE(n)	(CLKPR = 0x80, CLKPR = (n))
 
 
+/*
+ *  Settle time, in microseconds, between pulling a matrix line low and
+ *  reading the sense port.  The sense lines have to follow the line
+ *  through the key switch against the pullups; too short a wait reads
+ *  what the previous line left behind.  Set from the Makefile.
+ *
+ *  With SETTLE_CALIBRATE set, calibrateSettle() measures the time at
+ *  startup instead and SETTLE_US is only used if it cannot.
+ */
+#ifndef  SETTLE_US
+#define  SETTLE_US				5
+#endif
+
+#ifndef  SETTLE_CALIBRATE
+#define  SETTLE_CALIBRATE		0
+#endif
+
+#define  SETTLE_REF_US			100				/* long enough for any line to settle */
+#define  SETTLE_READS			4				/* reads that must agree during calibration */
+#define  SETTLE_LOOPS(us)		(((us) * (F_CPU / 1000000UL) + 2) / 3)	/* _delay_loop_1() is 3 cycles a pass */
+
+#if  SETTLE_CALIBRATE
+#if  SETTLE_LOOPS(SETTLE_US) > 255
+#error "SETTLE_US is too long for SETTLE_CALIBRATE"
+#endif
+uint8_t				settleLoops = SETTLE_LOOPS(SETTLE_US);	// settle time in _delay_loop_1() passes
+#define  settleDelay()			do { if (settleLoops)  _delay_loop_1(settleLoops); } while (0)
+#else
+#define  settleDelay()			_delay_us(SETTLE_US)
+#endif
+
+
+/*
+ *  Idle mode.  Once every key has been released and the raw matrix has
+ *  been quiet for IDLE_AFTER_MS, the scan stops strobing the lines one at
+ *  a time.  All strobe lines are left low, so a single read of the sense
+ *  port each tick shows any closed switch in the whole matrix.  The first
+ *  closed switch ends idle mode and the full scan runs in the same tick,
+ *  so a key press is seen no later than it would be without idle mode.
+ *
+ *  The sense lines are on PORTC, which has no pin change or external
+ *  interrupts on the at90usb1286, and the start of frame interrupt wakes
+ *  the CPU every millisecond while the host is polling anyway, so the
+ *  tick keeps running; idle mode only cuts each wakeup down to one port
+ *  read.  Debounce stands still meanwhile, which is safe once the quiet
+ *  time is longer than its windows.  Set from the Makefile; 0 disables it.
+ */
+#ifndef  IDLE_AFTER_MS
+#define  IDLE_AFTER_MS			500
+#endif
+
+
+/*
+ *  Keymap layers.  keyMapping[] holds one full map per layer; a key is
+ *  looked up in the highest active layer first and falls through every
+ *  cell holding KEY_TRNS to the layers below it, down to LAYER_BASE,
+ *  which is always active.  A cell holding LAYER_MO(n) makes layer n
+ *  active while its key is held, one holding LAYER_TG(n) turns layer n
+ *  on or off each time its key is pressed.  The layer a key was found in
+ *  when it was pressed is remembered, so its release is looked up in the
+ *  same layer even if the active layers have changed since.
+ *
+ *  Modifier keys are found in LAYER_BASE only; leave their cells
+ *  transparent in the other layers.
+ *
+ *  keyMapping[] is only the build-time default.  The scan reads the copy
+ *  in config.keymap, which may have been loaded from EEPROM instead and
+ *  which the host can change at run time (config.h).
+ */
+#define  LAYER_BASE				0
+#define  LAYER_KEYPAD			1				/* toggled with C= and <- */
+#define  LAYER_FN				2				/* while C= is held */
+#define  NUM_LAYERS				3				/* at most 8 */
+
+#define  KEY_TRNS				0xEF			/* transparent: use the layer below */
+#define  LAYER_MO(n)			(0xF0 + (n))	/* momentary layer key */
+#define  LAYER_TG(n)			(0xF8 + (n))	/* toggle layer key */
+
+typedef char  layerCodesFree[(KEY_SpecialEnd <= KEY_TRNS) ? 1 : -1];
+typedef char  keymapFitsConfig[(NUM_LAYERS == CONFIG_LAYERS) && (NUM_ROWS == CONFIG_ROWS) && (NUM_COLS == CONFIG_COLS) ? 1 : -1];
+
+
 /*
  *  Map the physical keys to rows and columns of the keyboard matrix.
  *
@@ -170,7 +266,7 @@
  *		   2         CRSR RL    A       D       G       J       L       ;      CTRL
  *		   3            F7      4       6       8       0       -    CLR/HOME   2
  *		   4            F1      Z       C       B       M       .    R shift   SPC
- *		   5            F3      S       F       H       K       :       =       C=
+ *		   5            F3      S       F       H       K       :       =    C= (Fn)
  *		   6            F5      E       T       U       O       @       ^       Q
  *		   7         CRSR DU  L shift   X       V       N       ,       /    RUN/STOP
  *
@@ -180,8 +276,9 @@
  *  you shift this key, you get }.  This isn't exactly how things work on a PC-101,
  *  but it's close and doesn't conflict with the M100 physical keycaps.
  */
-const uint8_t				keyMapping[NUM_ROWS][NUM_COLS]  PROGMEM  =
+const uint8_t				keyMapping[NUM_LAYERS][NUM_ROWS][NUM_COLS]  PROGMEM  =
 {
+  {	// LAYER_BASE
 //	  col 0		col 1		col 2		col 3		col 4		col 5		col 6		col 7
 //	-------------------------------------------------------------------------------------------
     {SPC_del, 	KEY_3, 		KEY_5, 		SPC_7, 		SPC_9, 		SPC_plus, 	SPC_pound, 	KEY_1}, // row0
@@ -189,10 +286,33 @@ const uint8_t				keyMapping[NUM_ROWS][NUM_COLS]  PROGMEM  =
     {SPC_crsrlr, KEY_A, 	KEY_D, 		KEY_G, 		KEY_J, 		KEY_L, 		SPC_smcol, 	MOD_LCTRL}, // row2
     {SPC_F7, 	KEY_4, 		SPC_6, 		SPC_8, 		SPC_0, 		SPC_minus, 	SPC_home, 	SPC_2}, // row3
     {SPC_F1, 	KEY_Z, 		KEY_C, 		KEY_B, 		KEY_M, 		KEY_dot, 	MOD_RSHIFT, KEY_spc}, // row4
-    {SPC_F3, 	KEY_S, 		KEY_F, 		KEY_H, 		KEY_K, 		SPC_colon, 	SPC_equal, 	MOD_LALT}, // row5
+    {SPC_F3, 	KEY_S, 		KEY_F, 		KEY_H, 		KEY_K, 		SPC_colon, 	SPC_equal, 	LAYER_MO(LAYER_FN)}, // row5
     {SPC_F5, 	KEY_E, 		KEY_T, 		KEY_U, 		KEY_O, 		SPC_at, 	SPC_hat, 	KEY_Q}, // row6
     {SPC_crsrud, MOD_LSHIFT, KEY_X, 	KEY_V, 		KEY_N, 		KEY_comma, 	KEY_slash, 	MOD_RALT}, // row7
     {MOD_RCTRL, 0, 			0, 			0, 			0, 			0, 			0, 			0} // Imaginary row8 is for restore
+  },
+  {	// LAYER_KEYPAD: 789/UIO/JKL/M as the keypad digits, + - * / and RETURN as keypad keys
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_KP7, 	KEY_KP9, 	KEY_KPplus, KEY_TRNS, 	KEY_TRNS}, // row0
+    {KEY_KPenter, KEY_TRNS, KEY_TRNS, 	KEY_TRNS, 	KEY_KP5, 	KEY_TRNS, 	KEY_KPast, 	KEY_TRNS}, // row1
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_KP1, 	KEY_KP3, 	KEY_TRNS, 	KEY_TRNS}, // row2
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_KP8, 	KEY_TRNS, 	KEY_KPminus, KEY_TRNS, 	KEY_TRNS}, // row3
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_KP0, 	KEY_KPcomma, KEY_TRNS, 	KEY_TRNS}, // row4
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_KP2, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS}, // row5
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_KP4, 	KEY_KP6, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS}, // row6
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_KPslash, KEY_TRNS}, // row7
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS}  // row8
+  },
+  {	// LAYER_FN, while C= is held: number row as F1-F12, navigation, keypad toggle on <-
+    {KEY_ins, 	KEY_F3, 	KEY_F5, 	KEY_F7, 	KEY_F9, 	KEY_F11, 	KEY_bckslsh, KEY_F1}, // row0
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	LAYER_TG(LAYER_KEYPAD)}, // row1
+    {KEY_end, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS}, // row2
+    {KEY_TRNS, 	KEY_F4, 	KEY_F6, 	KEY_F8, 	KEY_F10, 	KEY_F12, 	KEY_pgup, 	KEY_F2}, // row3
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS}, // row4
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS}, // row5
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS}, // row6
+    {KEY_pgdn, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS}, // row7
+    {KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS, 	KEY_TRNS}  // row8
+  }
 };
 /* M100 keymap
 	{KEY_Z,		KEY_X,		KEY_C,		KEY_V,		KEY_B,		KEY_N,		KEY_M,		KEY_L},
@@ -208,44 +328,25 @@ const uint8_t				keyMapping[NUM_ROWS][NUM_COLS]  PROGMEM  =
 
 
 /*
- *  Map of M100 keys to PC-101 keys (shows only unusual or M100-specific keys; see modifyKeyPressForM100())
- *
- *      M100 key		PC-101 key
- *  -----------------	----------
- *		BKSP			backspace
- *		shift-BKSP		delete
- *		GRPH			left-ALT
- *		CODE			right-ALT
- *		CAPS LOCK		Caps Lock
- *		NUM				Num Lock
- *		PASTE			{  (left curly-brace)
- *		shift-PASTE		}  (right curly-brace)
- *		alt-PASTE		F9
- *		[				[  (left bracket)
- *		shift-[			]  (right bracket)
- *		LABEL			\  (backslash)
- *		shift-LABEL		|  (vertical bar)
- *		alt-LABEL		F10
- *		alt-PRINT		F11
- *		PAUSE			`  (back-tick in Forth)
- *		shift-PAUSE		~  (tilde)
- *		alt-PAUSE		F12
- *		shift- <--		Home
- *		shift- -->		End
- *		shift- up-arrow	Page Up
- *		shift- dn-arrow	Page Down
+ *  Translation of the SPC_* codes in keyMapping[], one row per code in the
+ *  order of the SPC_* codes: key and modifier override when unshifted,
+ *  then key and modifier override when shifted.  The rows are generated
+ *  from SPECIAL_KEYS in usb_keyboard.h, and the check below stops the
+ *  build if the table and the SPC_* codes ever disagree in length.
  */
+#define  SPECIAL_KEY_ROW(name, key, mods, shiftKey, shiftMods)	{key, mods, shiftKey, shiftMods},
+
+const uint8_t				specialKeys[][4]  PROGMEM  =
+{
+	SPECIAL_KEYS(SPECIAL_KEY_ROW)
+};
+
+typedef char  specialKeysComplete[(sizeof(specialKeys) / sizeof(specialKeys[0]) == KEY_SpecialEnd - KEY_Special - 1) ? 1 : -1];
 
+#define  MASK_SHIFTS		(MOD_BIT(MOD_LSHIFT) | MOD_BIT(MOD_RSHIFT))
 
-#define  COL_MODIFIERS		7						/* M100 layout places all modifiers in col 8 */
-#define  ROW_RIGHT_SHIFT	0						/* row for right shift key */
-#define  ROW_LEFT_SHIFT		0						/* both SHIFT keys are wired together */
-#define  ROW_LEFT_CTRL		1						/* row for left-side CTRL key */
-#define  ROW_LEFT_ALT		2						/* this is actually labeled GRPH on M100 keyboard */
-#define  ROW_RIGHT_ALT		3						/* this is actually labeled CODE on M100 keyboard */
 
-#define  MASK_ALL_MODIFIERS  ((1<<ROW_RIGHT_SHIFT) | (1<<ROW_LEFT_SHIFT) | \
-							  (1<<ROW_LEFT_CTRL) | (1<<ROW_LEFT_ALT) | (1<<ROW_RIGHT_ALT))
+#define  MAX_MODIFIER_KEYS	16						/* most MOD_* cells keyMapping[] may hold */
 
 
 /*
@@ -253,54 +354,96 @@ const uint8_t				keyMapping[NUM_ROWS][NUM_COLS]  PROGMEM  =
  */
 uint16_t			rowData;
 uint16_t			colData;
-uint8_t				prevRowData[NUM_COLS];				// holds row data from previous scan
-uint8_t				currRowData[NUM_COLS];				// holds current row data
+uint8_t				rawRowData[NUM_ROWS];				// holds raw row data sampled this scan
+uint8_t				matrixData[2][NUM_ROWS];			// debounced row data, alternating between scans
+uint8_t				*prevRowData = matrixData[0];		// holds row data from previous scan
+uint8_t				*currRowData = matrixData[1];		// holds current (debounced) row data
+uint8_t				keyUsage[NUM_ROWS][NUM_COLS];		// usage each key is reporting, 0 if none
+uint8_t				keyMods[NUM_ROWS][NUM_COLS];		// modifier override each held SPC_* key applies
+uint8_t				lockReleasePending;					// a CAPS/NUM toggle went out, release it next scan
+uint8_t				edgeFound;							// this scan found a debounced edge...
+uint32_t			edgeTime;							// ...at this timer_micros() time
+uint8_t				idle;								// in idle mode, all strobe lines low
+uint32_t			lastActive;							// timer_millis() of the last key activity
+uint8_t				pressLayer[NUM_ROWS][NUM_COLS];		// layer each held key was found in
+uint8_t				layersHeld;							// layers turned on by held LAYER_MO() keys
+uint8_t				layersToggled;						// layers turned on by LAYER_TG() keys
+uint8_t				modifierCols[NUM_ROWS];				// columns of each row that hold MOD_* keys
+uint8_t				numModifierKeys;					// entries used in the three tables below
+uint8_t				modifierRow[MAX_MODIFIER_KEYS];		// row of each MOD_* key
+uint8_t				modifierCol[MAX_MODIFIER_KEYS];		// column bit of each MOD_* key
+uint8_t				modifierBit[MAX_MODIFIER_KEYS];		// HID modifier bit of each MOD_* key
 
 
 /*
  *  Local functions
  */
 void				scanKeyboard(void);					// update globals with current scan info
-uint8_t				modifyKeyPress(uint8_t  key);	// create psuedo keys for pressing
+uint8_t				modifyKeyPress(uint8_t  key, uint8_t  *mods);	// create psuedo keys for pressing
+void				dropSpecialKeys(void);				// end the overrides of held SPC_* keys
 uint8_t				modifyKeyRelease(uint8_t  key);	// create psuedo keys for releasing
-void				processSpecialKeys(uint8_t  key);	// may need to send release action for special keys
+void				processSpecialKeys(uint8_t  key);	// may need to queue a release action for special keys
+void				releaseLockKeys(void);				// drop CAPS/NUM toggles from keyUsage[]
+void				sendKeyReport(void);				// build the report from keyUsage[] and send it if changed
+void				calibrateSettle(void);				// measure the line settle time
+void				buildModifierTables(void);			// find the MOD_* keys in keyMapping[]
+uint8_t				lookupKey(uint8_t  rown, uint8_t  coln);	// resolve a pressed key through the layers
+uint8_t				layerKey(uint8_t  k, uint8_t  pressed);	// act on a layer key
+void				applyConfig(void);					// put the settings in config into effect
+uint8_t				idleCheck(void);					// stay in idle mode while no switch is closed
+void				ghostFilter(void);					// hold back presses that may be ghosts
+void				suspendKeyboard(void);				// sleep while the host has suspended the bus
 
 
 
 int main(void)
 {
-	uint8_t			n;
-
 	CPU_PRESCALE(0);					// set for 16 MHz clock
 	LED_OFF;
 	LED_CONFIG;
 
 /*
- *  Configure the row port for input; use internal pullups.
- *  Configure the column ports for output.
+ *  Configure the column port for input; use internal pullups.
+ *  Configure the row ports for output.
  */
-	DDR_COL = 0x00;						// set row port as inputs
+	DDR_COL = 0x00;						// set column port as inputs
 	PORT_COL = 0xff;					// turn on pullups
 	DDR_ROW_MSB = MASK_ROW_MSB;   
 	DDR_ROW_LSB = MASK_ROW_LSB;
 
-	// Initialize the USB, and then wait for the host to set configuration.
-	// If the Teensy is powered without a PC connected to the USB port,
-	// this will wait forever.
-	usb_init();
-	while (!usb_configured()) /* wait */ ;
+	config_init(&keyMapping[0][0][0]);	// settings from EEPROM, or the defaults
 
-	// Wait an extra second for the PC's operating system to load drivers
-	// and do whatever it does to actually be ready for input
-	_delay_ms(1000);
+	// Initialize the USB and start scanning at once, without waiting for
+	// the host: reports are queued while it enumerates the keyboard and
+	// go out as soon as it has set the configuration and polls for them,
+	// so keys pressed at power-on or during a re-enumeration are kept.
+	usb_init();
 
 
-	for (n=0; n<NUM_COLS; n++)  prevRowData[n] = 0xff;		// begin with no key pressed
+#if  SETTLE_CALIBRATE
+	calibrateSettle();
+#endif
 
+/*
+ *  Scan the matrix once per Timer1 tick (config.scan_rate_hz), sleeping in
+ *  between instead of spinning in a delay loop.  A pending EEPROM save
+ *  moves on by a byte each tick, and settings the host has changed take
+ *  effect before the next scan.
+ */
+	timer_init();
+	applyConfig();
 	while (1)
 	{
+		timer_wait_tick();
+		if (usb_suspended())
+		{
+			suspendKeyboard();
+			continue;
+		}
+		config_task();
+		if (config_update())  applyConfig();	// the host changed a setting
+		if (idleCheck())  continue;		// nothing closed, no scan needed
 		scanKeyboard();
-		_delay_ms(40);
 	}
 }
 
@@ -309,286 +452,509 @@ int main(void)
 /*
  *  scanKeyboard      scan the keyboard matrix, determine if any key has changed
  *
- *  This routine steps through each column in the keyboard matrix by pulling
- *  successive bits in the column I/O ports low, then recording the value of
- *  the row input port.  After a scan is done, the array currRowData[] holds
- *  all the scan info.
+ *  This routine steps through each of the nine rows in the keyboard matrix,
+ *  in the order of keyMapping[], by pulling successive bits in the row I/O
+ *  ports low, then recording all eight columns of the column input port in
+ *  rawRowData[].  The raw samples go to the edge recorder while the host
+ *  has it on (record.h), then through the debounce stage; after a scan is
+ *  done, the array currRowData[] holds the debounced scan info, one byte
+ *  per row.  currRowData and prevRowData swap between the two halves of
+ *  matrixData[] each scan, so the last scan's state never has to be
+ *  copied.
  *
- *  This routine then determines if a key change has occurred.  If so, the
- *  appropriate key actions are sent as USB packets to the PC.
+ *  This routine then determines if a key change has occurred.  A whole row
+ *  of edges is found with one XOR of its current and previous data, rows
+ *  without edges are skipped, and only the set bits of a row's edges are
+ *  visited, lowest first.  For each edge the usage recorded for that key in
+ *  keyUsage[] is updated.  Once every edge of the scan has been applied,
+ *  one report is built from every key still held and sent as a USB packet
+ *  to the PC, unless it is identical to the last report sent.
  */
 
 
 void  scanKeyboard(void)
 {
 	uint16_t				n;
-	uint8_t					coln;
 	uint8_t					rown;
+	uint8_t					coln;
 	uint16_t				mask;
 	uint8_t					k;
+	uint8_t					edges;
+	uint8_t					*swap;
 	uint8_t					needToProcess;
-	volatile uint16_t		delay;
+	uint8_t					quiet;
 
-	needToProcess = FALSE;				// nothing to do yet
-	for (n=0; n<NUM_COLS; n++)			// for all columns...
+	for (n=0; n<NUM_ROWS; n++)			// for all rows...
 	{
-		mask = 0xffff & ~(1<<n);		// get a bit mask for selected column (active low)
+		mask = 0xffff & ~(1<<n);		// get a bit mask for selected row (active low)
 		PORT_ROW_LSB = (mask & MASK_ROW_LSB);		// set LSB
 		PORT_ROW_MSB = (mask >> 8) & MASK_ROW_MSB;	// set MSB
-		for (delay=0; delay<500; delay++)  ;
-		currRowData[n] = PIN_COL;		// get the scan result for that column
-		if (currRowData[n] != prevRowData[n])	// if there is a difference...
-		{
-//			if ((n != COL_MODIFIERS) || 
-//				((~currRowData[n] | MASK_ALL_MODIFIERS) != MASK_ALL_MODIFIERS))	// and not a modifier...
-//			{
-				needToProcess = TRUE;
-//			}
-		}
+		settleDelay();					// let the sense lines follow
+		rawRowData[n] = PIN_COL;		// get all eight columns of that row at once
 	}
 	    
-	PORT_ROW_LSB = 0xff;				// done for now, pull all columns high
+	PORT_ROW_LSB = 0xff;				// done for now, pull all rows high
 	PORT_ROW_MSB = MASK_ROW_MSB;
+	if (record_on)  record_scan(rawRowData, NUM_ROWS);	// the host is recording key edges
 
-	if (needToProcess)					// if something to do...
+	swap = prevRowData;					// this scan's state goes over the one before last
+	prevRowData = currRowData;
+	currRowData = swap;
+	needToProcess = debounce_update(rawRowData, prevRowData, currRowData, NUM_ROWS);	// any debounced change?
+	if (needToProcess)  ghostFilter();	// no new press can be a ghost otherwise
+	edgeFound = needToProcess;
+	if (edgeFound)  edgeTime = timer_micros();	// stamp the report it causes, see latency.h
+
+	if (lockReleasePending)				// last report toggled CAPS or NUM, release it now
 	{
-		for (n=0; n<6; n++)  keyboard_keys[n] = 0;	// magic number; clear out all keys in USB buffer
+		releaseLockKeys();
+		lockReleasePending = 0;
+		needToProcess = 1;
+	}
 
+	if (needToProcess)					// if something to do...
+	{
 //
-//  All of the modifier keys, such as LEFT_CTRL, are in column 8,
-//   so check the modifiers first.  Save the state of all modifiers in
-//   the global variable keyboard_modifiers_keys, used by the USB library.
+//  Check the modifiers first.  Every key whose keyMapping[] cell holds a
+//   MOD_* code was found by buildModifierTables(); save the state of all
+//   of them as HID modifier bits in the global variable keyboard_modifier_keys,
+//   used by the USB library.
 //
-		mask = currRowData[COL_MODIFIERS];		// reuse mask for brevity
 		keyboard_modifier_keys = 0;				// start with no modifiers pressed
-		if ((mask & (1<<ROW_LEFT_SHIFT)) == 0)   keyboard_modifier_keys |= MOD_LSHIFT;
-		if ((mask & (1<<ROW_RIGHT_SHIFT)) == 0)  keyboard_modifier_keys |= MOD_RSHIFT;
-		if ((mask & (1<<ROW_LEFT_CTRL)) == 0)    keyboard_modifier_keys |= MOD_LCTRL;
-		if ((mask & (1<<ROW_LEFT_ALT)) == 0)     keyboard_modifier_keys |= MOD_LALT;
-		if ((mask & (1<<ROW_RIGHT_ALT)) == 0)    keyboard_modifier_keys |= MOD_RALT;
-//		if (keyboard_modifier_keys)  usb_keyboard_send();	// if any modifier changed, update host now
-
-		for (coln=0; coln<NUM_COLS; coln++)		// for all columns...
+		for (n=0; n<numModifierKeys; n++)
 		{
-			for (rown=0; rown<NUM_ROWS; rown++)		// for all rows...
-			{
+			if ((currRowData[modifierRow[n]] & modifierCol[n]) == 0)  keyboard_modifier_keys |= modifierBit[n];
+		}
+
+		for (rown=0; rown<NUM_ROWS; rown++)		// for all rows...
+		{
+			edges = currRowData[rown] ^ prevRowData[rown];	// every key that changed
 //
-//  The following block only sends a key action (pressed or released) for keys
-//  that are not in the modifier group.  We don't send key actions for modifiers;
-//  current state of the modifier keys is already collected in the keyboard_modifier_keys
+//  Only send key actions (pressed or released) for keys that are not in the
+//  modifier group.  We don't send key actions for modifiers; current state of
+//  the modifier keys is already collected in the keyboard_modifier_keys
 //  variable above.
 //
-				if ((coln == COL_MODIFIERS) && ((1<<rown) & MASK_ALL_MODIFIERS)) continue;  // ignore modifiers
+			edges &= ~modifierCols[rown];		// ignore modifiers
+
+			while (edges)						// for each changed column, lowest first...
+			{
+				coln = __builtin_ctz(edges);
+				edges &= edges - 1;				// clear the lowest set bit
+				if (currRowData[rown] & (1<<coln))		// if this key was just released...
+				{
+					k = config.keymap[pressLayer[rown][coln]][rown][coln];	// as it was pressed
+					if (layerKey(k, FALSE))  continue;
 
-				if ((currRowData[coln] & (1<<rown)) != (prevRowData[coln] & (1<<rown)))	// if key changed...
+					k = modifyKeyRelease(k);		// if needed, modify key and modifiers
+					keyUsage[rown][coln] = k;		// normally 0, dropping it from the report
+					keyMods[rown][coln] = SPC_KEEP;
+					LED_OFF;
+				}
+				else				  					// key was just pressed...
 				{
-					k = pgm_read_byte(&keyMapping[coln][rown]);	// get first draft of key
-					if (currRowData[coln] & (1<<rown))		// if this key was just released...
-					{
-						k = modifyKeyRelease(k);		// if needed, modify key and modifiers
-						keyboard_keys[0] = k;
-						usb_keyboard_send();
-						LED_OFF;
-					}
-					else				  					// key was just pressed...
-					{
-						k = modifyKeyPress(k);		// if needed, modify key and modifiers
-						keyboard_keys[0] = k;
-						usb_keyboard_send();
-						LED_ON;
-					}
-					processSpecialKeys(k);					// may need to do extra processing...
+					k = lookupKey(rown, coln);			// get first draft of key
+					if (layerKey(k, TRUE))  continue;
+					dropSpecialKeys();					// their overrides would apply to this key too
+					k = modifyKeyPress(k, &keyMods[rown][coln]);	// if needed, modify key and modifiers
+					keyUsage[rown][coln] = k;		// keeps this usage until released
+					LED_ON;
 				}
+				processSpecialKeys(k);					// may need to do extra processing...
 			}
 		} 
+		sendKeyReport();						// one report for all of this scan's edges
+		edgeFound = 0;
+	}
+
+//
+//  Go idle once no switch has been closed, raw or debounced, for
+//  IDLE_AFTER_MS.
+//
+	quiet = 0xff;
+	for (n=0; n<NUM_ROWS; n++)  quiet &= rawRowData[n] & currRowData[n];
+	if ((quiet != 0xff) || needToProcess)
+	{
+		lastActive = timer_millis();
+	}
+	else if (IDLE_AFTER_MS && (timer_millis() - lastActive >= IDLE_AFTER_MS))
+	{
+		PORT_ROW_LSB = 0;					// pull all rows low, any closed switch reads low
+		PORT_ROW_MSB = 0;
+		idle = TRUE;
 	}
-	for (n=0; n<NUM_COLS; n++)  prevRowData[n] = currRowData[n];	// record as previous data
 }
 
 
 
+/*
+ *  suspendKeyboard      sleep while the host has suspended the bus
+ *
+ *  All strobe lines are pulled low, as in idle mode, and the CPU sleeps
+ *  in power-down; the watchdog wakes it every 16 ms to read the sense
+ *  port once.  A switch that closes after every switch has been seen
+ *  open asks the host to resume the bus, and the scan takes over again
+ *  at once, so the waking key is debounced and reported as usual; its
+ *  report waits in the queue until the host has resumed the bus.  Keys
+ *  already held when the bus was suspended do not wake it, and keys
+ *  pressed while the host does not allow remote wakeup are ignored.
+ *
+ *  Returns when the bus has resumed, or on a remote wakeup.
+ */
+void  suspendKeyboard(void)
+{
+	uint8_t					armed = FALSE;
+
+	PORT_ROW_LSB = 0;						// any closed switch reads low
+	PORT_ROW_MSB = 0;
+	while (usb_suspended())
+	{
+		timer_power_down();
+		if (PIN_COL == 0xff)
+		{
+			armed = TRUE;
+		}
+		else if (armed)
+		{
+			if (usb_remote_wakeup() == 0)  break;
+			armed = FALSE;					// not allowed, wait for another press
+		}
+	}
+	idle = FALSE;							// full scans until quiet again
+	lastActive = timer_millis();
+}
+
 
 
 /*
- *  modifyKeyPressForM100      adjust the value for a pressed key based on context
+ *  idleCheck      stay in idle mode while no switch is closed
  *
- *  This routine uses the current key and the current state of the modifier keys to
- *  select, if needed, an alternate key.  This is needed because of the limited number
- *  of keys on the M100 keyboard and also because the M100 keyboard layout is not
- *  compatible with the standard PC-101 keyboard.
+ *  Returns TRUE if the keyboard is idle and the sense port still reads
+ *  every switch open, so this tick needs no scan.  The strobe lines have
+ *  been low since the scan that went idle, so they need no settle time.
+ *  A closed switch ends idle mode and returns FALSE; scanKeyboard() drives
+ *  the lines one at a time again.
+ */
+uint8_t  idleCheck(void)
+{
+	if (!idle)  return  FALSE;
+	if (PIN_COL == 0xff)  return  TRUE;
+	idle = FALSE;
+	lastActive = timer_millis();
+	return  FALSE;
+}
+
+
+
+/*
+ *  ghostFilter      hold back new presses that may be ghosts
  *
- *  For example, the M100 keyboard has the right-brace (right-square-bracket) key
- *  and the left-brace key on the same keycap, whereas the PC-101 layout uses separate
- *  keycaps.
+ *  The matrix has no diodes, so with switches closed at three corners of
+ *  a rectangle the fourth corner reads closed too, and nothing tells it
+ *  from a real key.  Two rows whose closed columns overlap in two or more
+ *  places form such a rectangle, and every key in the shared columns of
+ *  either row is ambiguous.  The overlap is the AND of the two rows'
+ *  inverted data; x & (x - 1) is non-zero when it has two or more bits
+ *  set, so no bit count is needed.
  *
- *  Upon entry, argument key holds the current key value (as in KEY_A) and the global
- *  variable keyboard_modifier_keys holds the current state of all modifier keys.
+ *  An ambiguous key that was already pressed after the last scan stays
+ *  pressed: it was read before the rectangle closed.  An ambiguous new
+ *  press is put back to released in currRowData.  The debounce then finds
+ *  it again next scan, and it goes to the host once the rectangle has
+ *  opened.  Keys outside any rectangle, the rollover the matrix can
+ *  resolve, are never held.
  *
- *  Upon exit, this routine returns the changed key value (if necessary).  This routine
- *  may also alter the mask in the keyboard_modifier_keys variable, to remove
- *  shift or ctrl key states.
- */
-  /* 
-  KEY_Special,
-  SPC_2,
-  SPC_6,
-  SPC_7,
-  SPC_8,
-  SPC_9,
-  SPC_0,
-  SPC_plus,
-  SPC_minus,
-  SPC_pound,
-  SPC_home,
-  SPC_del,
-  SPC_ast,
-  SPC_equal,
-  SPC_crsrud,
-  SPC_crsrlr,
-  SPC_F1,
-  SPC_F3,
-  SPC_F5,
-  SPC_F7,
-  SPC_hat,
-  SPC_colon,
-  SPC_smcol,
-  SPC_at
-  Special keys that need to generate different scan-codes for unshifted
-   and shifted states, or that need to alter the modifier keys. 
-   Since the LGUI and RGUI bits are not used, these signify that the
-   left and right shift states should be deleted from report, so
-     0x88 means clear both shift flags
-     0x00 means do not alter shift states
-     0xC8 means clear both shifts and set L_ALT */
-/*
-const unsigned char spec_keys[23][4] PROGMEM = {
-  { KEY_2,       0x00, KEY_ping,    0x00}, // SPC_2 - shift-2 is "
-  { KEY_6,       0x00, KEY_7,       0x00}, // SPC_6 - shift-6 is &
-  { KEY_7,       0x00, KEY_ping,    0x88}, // SPC_7 - shift-7 is '
-  { KEY_8,       0x00, KEY_9,       0x00}, // SPC_8 - shift-8 is (
-  { KEY_9,       0x00, KEY_0,       0x00}, // SPC_9 - shift-9 is )
-  { KEY_0,       0x00, KEY_0,       0x88}, // SPC_0 - shift-0 is 0
-  { KEY_equal,   0x02, KEY_equal,   0x8A}, // SPC_plus 
-  { KEY_minus,   0x00, KEY_minus,   0x88}, // SPC_minus - "-" and "-"
-  { KEY_grave,   0x02, KEY_grave,   0x8A}, // SPC_pound - "~"
-  { KEY_home,    0x80, KEY_end,     0x80}, // SPC_home - home and end
-  { KEY_bckspc,  0x00, KEY_del,     0x88}, // SPC_del - backspace and delete
-  { KEY_8,       0x02, KEY_8,       0x02}, // SPC_ast - "*" (Asterix)
-  { KEY_equal,   0x00, KEY_equal,   0x88}, // SPC_equal - "="
-  { KEY_darr,    0x80, KEY_uarr,    0x80}, // SPC_crsrud - cursor down/up
-  { KEY_rarr,    0x80, KEY_larr,    0x80}, // SPC_crsrlr - cursor right/left
-  { KEY_F1,      0x80, KEY_F2,      0x80}, // SPC_F1 - F1 and F2
-  { KEY_F3,      0x80, KEY_F4,      0x80}, // SPC_F3 - F3 and F4
-  { KEY_F5,      0x80, KEY_F6,      0x80}, // SPC_F5 - F5 and F6
-  { KEY_F7,      0x80, KEY_F8,      0x80}, // SPC_F7 - F7 and F8
-  { KEY_6,       0x02, KEY_6,       0x00}, // SPC_hat - "^"
-  { KEY_smcol,   0x02, KEY_lbr,     0x88}, // SPC_colon - : and [
-  { KEY_smcol,   0x00, KEY_rbr,     0x88}, // SPC_smcol - ; and ]
-  { KEY_2,       0x8A, KEY_2,       0x8A}, // SPC_at - @
- };
+ *  Only rows with two or more closed switches can form a rectangle.  With
+ *  fewer than two such rows the cost is one test per row.
  */
-uint8_t  modifyKeyPress(uint8_t  k)
+void  ghostFilter(void)
 {
-	switch(k)
+	uint8_t					rows[NUM_ROWS];		// rows with two or more switches closed
+	uint8_t					hold[NUM_ROWS];		// their ambiguous columns
+	uint8_t					numRows = 0;
+	uint8_t					closed;
+	uint8_t					shared;
+	uint8_t					i;
+	uint8_t					j;
+
+	for (i=0; i<NUM_ROWS; i++)
 	{
-		case  KEY_2:
-		if (keyboard_modifier_keys & (MOD_LSHIFT|MOD_RSHIFT))	// shift-backspace = delete
-		{
-			k = KEY_ping;
-			keyboard_modifier_keys &= ~(MOD_LSHIFT|MOD_RSHIFT);	// must remove shift modifiers!
-		}
-		break;
+		closed = ~currRowData[i];
+		if (closed & (closed - 1))  rows[numRows++] = i;
+	}
+	if (numRows < 2)  return;
 
-		case  KEY_6:
-		if (keyboard_modifier_keys & (MOD_LSHIFT|MOD_RSHIFT))	// shift-up = page-up
+	for (i=0; i<numRows; i++)  hold[i] = 0;
+	for (i=0; i<numRows; i++)
+	{
+		for (j=i+1; j<numRows; j++)
 		{
-			k = KEY_pgup;							// pretend we have a page-up key
-			keyboard_modifier_keys &= ~(MOD_LSHIFT|MOD_RSHIFT);	// must remove shift modifiers!
+			shared = ~currRowData[rows[i]] & ~currRowData[rows[j]];
+			if (shared & (shared - 1))
+			{
+				hold[i] |= shared;
+				hold[j] |= shared;
+			}
 		}
-		break;
+	}
+	for (i=0; i<numRows; i++)
+	{
+		currRowData[rows[i]] |= hold[i] & prevRowData[rows[i]];	// new presses only
+	}
+}
 
-		case  KEY_darr:
-		if (keyboard_modifier_keys & (MOD_LSHIFT|MOD_RSHIFT))	// shift-down = page-down
-		{
-			k = KEY_pgdn;							// pretend we have a page-down key
-			keyboard_modifier_keys &= ~(MOD_LSHIFT|MOD_RSHIFT);	// must remove shift modifiers!
-		}
-		break;
 
-		case  KEY_rarr:
-		if (keyboard_modifier_keys & (MOD_LSHIFT|MOD_RSHIFT))	// shift-right = end
-		{
-			k = KEY_end;
-			keyboard_modifier_keys &= ~(MOD_LSHIFT|MOD_RSHIFT);	// must remove shift modifiers!
-		}
-		break;
 
-		case  KEY_larr:
-		if (keyboard_modifier_keys & (MOD_LSHIFT|MOD_RSHIFT))	// shift-left = home
-		{
-			k = KEY_home;
-			keyboard_modifier_keys &= ~(MOD_LSHIFT|MOD_RSHIFT);	// must remove shift modifiers!
-		}
-		break;
 
-		case  KEY_lbr:
-		if (keyboard_modifier_keys & (MOD_LSHIFT|MOD_RSHIFT))	// shift-[ = ]
-		{
-			k = KEY_rbr;
-			keyboard_modifier_keys &= ~(MOD_LSHIFT|MOD_RSHIFT);	// must remove shift modifiers!
-		}
-		break;
 
-		case  KEY_F9:										// "PASTE", 1st key in 3rd function key group
-		if (keyboard_modifier_keys & (MOD_LSHIFT|MOD_RSHIFT))	// shift-PASTE = }
-		{
-			k = KEY_rbr;							// this would be SHIFT-] on PC-101 kbd
-		}
-		else if (keyboard_modifier_keys &(MOD_LALT|MOD_RALT))	// ALT-PASTE = F9
-		{
-			k = KEY_F9;
-			keyboard_modifier_keys &= ~(MOD_LALT|MOD_RALT);	// must remove ALT modifiers!
-		}
-		else												// not shifted, PASTE becomes {
+/*
+ *  buildModifierTables      find the modifier keys in keyMapping[]
+ *
+ *  Every cell of keyMapping[] that holds a MOD_* code is a modifier key:
+ *  its column goes into modifierCols[] for its row, so scanKeyboard() can
+ *  mask modifiers out of a row's edges in one step, and its row, column
+ *  bit and HID modifier bit go into the modifier list, so the modifier
+ *  byte takes one test per modifier key to build.  Called by applyConfig(),
+ *  at startup and after every change to the keymap.
+ */
+void  buildModifierTables(void)
+{
+	uint8_t					rown;
+	uint8_t					coln;
+	uint8_t					k;
+
+	numModifierKeys = 0;
+	for (rown=0; rown<NUM_ROWS; rown++)
+	{
+		modifierCols[rown] = 0;
+		for (coln=0; coln<NUM_COLS; coln++)
 		{
-			k = KEY_lbr;
-			keyboard_modifier_keys |= MOD_LSHIFT;		// this would be SHIFT-[ on PC-101 kbd
+			k = config.keymap[LAYER_BASE][rown][coln];
+			if ((k < MOD_LCTRL) || (k > MOD_RGUI))  continue;
+			modifierCols[rown] |= (1<<coln);	// never reported as a key
+			if (numModifierKeys == MAX_MODIFIER_KEYS)  continue;
+			modifierRow[numModifierKeys] = rown;
+			modifierCol[numModifierKeys] = (1<<coln);
+			modifierBit[numModifierKeys] = MOD_BIT(k);
+			numModifierKeys++;
 		}
-		break;
+	}
+}
+
+
+
+/*
+ *  applyConfig      put the settings in config into effect
+ *
+ *  Sets the scan rate and phase and the debounce, and rebuilds the
+ *  modifier tables from the keymap.  Every key is taken as released, and
+ *  the report sent to say so; keys still held are found again by the
+ *  following scans, so a key held across a change comes back with the
+ *  code of its new cell.
+ */
+void  applyConfig(void)
+{
+	uint8_t					rown;
+	uint8_t					coln;
+
+	timer_set_rate(config.scan_rate_hz);
+	timer_set_phase(config.scan_phase_us);
+	debounce_configure(config.debounce_algorithm, config.debounce_press_ms, config.debounce_release_ms);
+	for (rown=0; rown<NUM_ROWS; rown++)
+	{
+		matrixData[0][rown] = matrixData[1][rown] = 0xff;
+		for (coln=0; coln<NUM_COLS; coln++)  keyUsage[rown][coln] = keyMods[rown][coln] = 0;
+	}
+	layersHeld = 0;
+	layersToggled = 0;
+	lockReleasePending = 0;
+	keyboard_modifier_keys = 0;
+	idle = FALSE;								// full scans until quiet again
+	lastActive = timer_millis();
+	buildModifierTables();
+	sendKeyReport();
+}
+
+
 
-		case  KEY_bckslsh:								// "LABEL", 2nd key in 3rd function key group
-		if (keyboard_modifier_keys &(MOD_LALT|MOD_RALT))	// ALT-LABEL = F10
+/*
+ *  lookupKey      find the key at a matrix position in the active layers
+ *
+ *  Reads the position in each active layer from the highest down and
+ *  returns the first cell that is not KEY_TRNS; at most NUM_LAYERS table
+ *  reads.  The layer it was found in is recorded in pressLayer[] for the
+ *  key's release.
+ */
+uint8_t  lookupKey(uint8_t  rown, uint8_t  coln)
+{
+	uint8_t					active;
+	uint8_t					layer;
+	uint8_t					k;
+
+	active = (1<<LAYER_BASE) | layersHeld | layersToggled;
+	for (layer=NUM_LAYERS-1; layer>LAYER_BASE; layer--)
+	{
+		if ((active & (1<<layer)) == 0)  continue;
+		k = config.keymap[layer][rown][coln];
+		if (k != KEY_TRNS)
 		{
-			k = KEY_F10;
-			keyboard_modifier_keys &= ~(MOD_LALT|MOD_RALT);	// must remove ALT modifiers!
+			pressLayer[rown][coln] = layer;
+			return  k;
 		}
-		break;
+	}
+	pressLayer[rown][coln] = LAYER_BASE;
+	return  config.keymap[LAYER_BASE][rown][coln];
+}
+
+
+
+/*
+ *  layerKey      act on a press or release of a layer key
+ *
+ *  Returns TRUE if k was a layer key, which is then not reported to the
+ *  host, or FALSE for any other key.
+ */
+uint8_t  layerKey(uint8_t  k, uint8_t  pressed)
+{
+	if (k >= LAYER_TG(0))
+	{
+		if (pressed)  layersToggled ^= (1 << (k - LAYER_TG(0)));
+		return  TRUE;
+	}
+	if (k >= LAYER_MO(0))
+	{
+		if (pressed)  layersHeld |= (1 << (k - LAYER_MO(0)));
+		else  layersHeld &= ~(1 << (k - LAYER_MO(0)));
+		return  TRUE;
+	}
+	return  FALSE;
+}
 
-		case  KEY_PrtScr:								// "PRINT", 3rd key in 3rd function key group
-		if (keyboard_modifier_keys &(MOD_LALT|MOD_RALT))	// ALT-PRINT = F11
+
+
+#if  SETTLE_CALIBRATE
+/*
+ *  calibrateSettle      find the shortest settle time that reads the matrix reliably
+ *
+ *  Reads every line once after a generous delay for reference, then tries
+ *  settle times from the shortest up, stepping through the lines in scan
+ *  order as scanKeyboard() does, until SETTLE_READS back-to-back reads of
+ *  every line match its reference.  settleLoops gets twice that, for
+ *  margin.
+ *
+ *  A line only shows its settle time when a key on it is closed; if none
+ *  is, there is nothing to measure and settleLoops keeps SETTLE_US.
+ */
+void  calibrateSettle(void)
+{
+	uint8_t					ref[NUM_ROWS];
+	uint8_t					n;
+	uint8_t					i;
+	uint8_t					loops;
+	uint8_t					stable;
+	uint8_t					anyClosed;
+	uint16_t				mask;
+
+	anyClosed = FALSE;
+	for (n=0; n<NUM_ROWS; n++)
+	{
+		mask = 0xffff & ~(1<<n);
+		PORT_ROW_LSB = (mask & MASK_ROW_LSB);
+		PORT_ROW_MSB = (mask >> 8) & MASK_ROW_MSB;
+		_delay_us(SETTLE_REF_US);
+		ref[n] = PIN_COL;
+		if (ref[n] != 0xff)  anyClosed = TRUE;
+	}
+	PORT_ROW_LSB = 0xff;
+	PORT_ROW_MSB = MASK_ROW_MSB;
+	if (!anyClosed)  return;
+
+	for (loops=1; loops<255; loops++)
+	{
+		_delay_us(SETTLE_REF_US);				// start from all lines released
+		stable = TRUE;
+		for (n=0; n<NUM_ROWS && stable; n++)
 		{
-			k = KEY_F11;
-			keyboard_modifier_keys &= ~(MOD_LALT|MOD_RALT);	// must remove ALT modifiers!
+			mask = 0xffff & ~(1<<n);
+			PORT_ROW_LSB = (mask & MASK_ROW_LSB);
+			PORT_ROW_MSB = (mask >> 8) & MASK_ROW_MSB;
+			_delay_loop_1(loops);
+			for (i=0; i<SETTLE_READS; i++)
+			{
+				if (PIN_COL != ref[n])  stable = FALSE;
+			}
 		}
-		break;
+		PORT_ROW_LSB = 0xff;
+		PORT_ROW_MSB = MASK_ROW_MSB;
+		if (stable)  break;
+	}
+	settleLoops = (loops < 128) ? (loops * 2) : 255;
+}
+#endif
+
+
+
+
+/*
+ *  modifyKeyPress      translate a pressed key based on context
+ *
+ *  Keys in keyMapping[] whose shifted symbol is not the PC-101 shifted
+ *  symbol of the same keycap hold one of the SPC_* codes.  Those are
+ *  translated with one row of specialKeys[], chosen by the shift state:
+ *  the row gives the key to send and a modifier override, which may
+ *  remove both shifts (SPC_UNSHIFT) and may add modifiers (such as
+ *  SPC_SHIFT).  Every other key is returned unchanged, with no override.
+ *
+ *  Upon entry, argument key holds the current key value (as in SPC_2) and the global
+ *  variable keyboard_modifier_keys holds the current state of all modifier keys.
+ *
+ *  Upon exit, this routine returns the changed key value (if necessary) and
+ *  stores the override in mods, the key's entry in keyMods[]; sendKeyReport()
+ *  applies it to every report sent while the key is held.
+ */
+uint8_t  modifyKeyPress(uint8_t  k, uint8_t  *mods)
+{
+	const uint8_t			*row;
+
+	*mods = SPC_KEEP;
+	if ((k <= KEY_Special) || (k >= KEY_SpecialEnd))  return  k;	// not a special key
+
+	row = specialKeys[k - KEY_Special - 1];
+	if (keyboard_modifier_keys & MASK_SHIFTS)  row += 2;		// use the shifted half
+	k = pgm_read_byte(row);
+	*mods = pgm_read_byte(row + 1);
+	return  k;
+}
+
+
 
-		case  KEY_grave:									// "BREAK", 4th key in 3rd function key group
-		if (keyboard_modifier_keys &(MOD_LALT|MOD_RALT))	// ALT-BREAK = F12
+/*
+ *  dropSpecialKeys      take every held key with a modifier override out of the report
+ *
+ *  A report has one modifier byte, so an override would also change any
+ *  other key reported with it.  When another key is pressed, the held
+ *  SPC_* keys that have an override stop being reported, as if they had
+ *  been released; their symbols have already gone out.
+ */
+void  dropSpecialKeys(void)
+{
+	uint8_t			rown;
+	uint8_t			coln;
+
+	for (rown=0; rown<NUM_ROWS; rown++)
+	{
+		for (coln=0; coln<NUM_COLS; coln++)
 		{
-			k = KEY_F12;
-			keyboard_modifier_keys &= ~(MOD_LALT|MOD_RALT);	// must remove ALT modifiers!
+			if (keyMods[rown][coln] == SPC_KEEP)  continue;
+			keyUsage[rown][coln] = 0;
+			keyMods[rown][coln] = SPC_KEEP;
 		}
-		break;
-
-		default:
-		break;
 	}
-	return  k;
 }
 
 
 /*
- *  modifyKeyReleaseForM100      adjust the value of a released key based on context
+ *  modifyKeyRelease      adjust the value of a released key based on context
  *
  *  This routine alters (if needed) the value of the key that is being released.  This
  *  is required because two keys, CAPS and NUM, are push-on/push-off keys on the
@@ -631,6 +997,46 @@ uint8_t  modifyKeyRelease(uint8_t  key)
 
 
 
+/*
+ *  sendKeyReport      build a report from every key held and send it
+ *
+ *  Collects the non-zero entries of keyUsage[] in scan order and lets the
+ *  report builder assign them to the six keyboard_keys[] slots, so keys
+ *  that are held together are all reported, each in a stable slot.  The
+ *  modifier overrides in keyMods[] of the SPC_* keys held are applied to
+ *  keyboard_modifier_keys, so they last as long as the keys.  The
+ *  report is only sent if it differs from the last one sent.  A report
+ *  caused by a debounced edge carries the edge's time (edgeTime) for the
+ *  latency statistics.
+ */
+void  sendKeyReport(void)
+{
+	uint8_t			held[NUM_ROWS * NUM_COLS];
+	uint8_t			count;
+	uint8_t			mods;
+	uint8_t			rown;
+	uint8_t			coln;
+
+	count = 0;
+	mods = SPC_KEEP;
+	for (rown=0; rown<NUM_ROWS; rown++)
+	{
+		for (coln=0; coln<NUM_COLS; coln++)
+		{
+			if (keyUsage[rown][coln])  held[count++] = keyUsage[rown][coln];
+			mods |= keyMods[rown][coln];
+		}
+	}
+	if (mods & SPC_UNSHIFT)  keyboard_modifier_keys &= ~MASK_SHIFTS;
+	keyboard_modifier_keys |= (mods & ~SPC_UNSHIFT);
+	report_build(held, count);
+	if (!report_changed())  return;
+	if (edgeFound)  usb_keyboard_send_stamped(edgeTime);
+	else  usb_keyboard_send();
+}
+
+
+
 /*
  *  processSpecialKeys      post-processing, used only for certain keys
  *
@@ -644,6 +1050,9 @@ uint8_t  modifyKeyRelease(uint8_t  key)
  *  a PC-101 keyboard, CAPS-LOCK and NUM-LOCK are soft keys, not push-on/
  *  push-off, as on the M100 keyboard.)
  *
+ *  Only one report goes out per scan, so the release is not sent here;
+ *  this routine notes that it is owed and the next scan sends it.
+ *
  *  Upon entry, argument key holds the key code for the key in question.
  */
 void  processSpecialKeys(uint8_t  key)
@@ -652,8 +1061,7 @@ void  processSpecialKeys(uint8_t  key)
 	{
 		case  KEY_cpslck:
 		case  KEY_numlock:
-		keyboard_keys[0] = 0;
-		usb_keyboard_send();
+		lockReleasePending = 1;
 		break;
 
 		default:
@@ -663,5 +1071,25 @@ void  processSpecialKeys(uint8_t  key)
 
 
 
+/*
+ *  releaseLockKeys      drop CAPS and NUM toggles from keyUsage[]
+ */
+void  releaseLockKeys(void)
+{
+	uint8_t			rown;
+	uint8_t			coln;
+
+	for (rown=0; rown<NUM_ROWS; rown++)
+	{
+		for (coln=0; coln<NUM_COLS; coln++)
+		{
+			if ((keyUsage[rown][coln] == KEY_cpslck) || (keyUsage[rown][coln] == KEY_numlock))
+				keyUsage[rown][coln] = 0;
+		}
+	}
+}
+
+
+
 
 
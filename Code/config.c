@@ -0,0 +1,334 @@
+/*
+ *  config.c
+ *
+ *  Runtime settings for the Vic-20 USB keyboard, cached in RAM and kept
+ *  in wear-levelled EEPROM slots; see config.h.
+ *
+ *  The USB interrupt reads and changes staged, never config, which only
+ *  the main loop writes, in config_update().
+ *
+ *  A save copies the settings into slotImage[] with a new sequence number
+ *  and CRC, then config_task() writes it out from the main loop, one byte
+ *  per call while the EEPROM is ready, so a save never blocks the scan
+ *  for the 3.4 ms each EEPROM byte takes.  Bytes that already hold the
+ *  right value are skipped.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include "config.h"
+#include "debounce.h"
+#include "timer.h"
+#include "record.h"
+#include "latency.h"
+
+
+struct config_slot {
+	uint16_t			sequence;
+	struct config_data	data;
+	uint16_t			crc;			// CRC-CCITT of everything above
+};
+
+typedef char  configSlotFits[(sizeof(struct config_slot) <= CONFIG_SLOT_SIZE) ? 1 : -1];
+typedef char  configReadFits[(RECORD_READ_SIZE <= LATENCY_REPORT_SIZE) ? 1 : -1];	// ep0_buf in usb_keyboard.c
+
+#define  SLOT_ADDR(slot, pos)		((uint8_t *)(uintptr_t)((slot) * CONFIG_SLOT_SIZE + (pos)))
+
+
+struct config_data			config;
+
+static struct config_data	staged;			// the host's settings, changed by the USB interrupt
+static volatile uint8_t		stagedSeq;		// bumped on every change to staged
+static volatile uint8_t		changed;		// staged differs from config
+
+static const uint8_t		*defaultKeymap;
+static struct config_slot	slotImage;		// slot being saved, or scratch while loading
+static uint8_t				slot;			// slot last loaded or saved
+static uint16_t				sequence;		// its sequence number
+static uint8_t				stored;			// slot holds saved settings
+static volatile uint8_t		modified;		// changed since loaded or saved
+static volatile uint8_t		saveRequested;
+static uint8_t				saving;			// slotImage is being written out
+static uint16_t				savePos;		// next byte of slotImage to write
+
+
+
+// CRC-CCITT of a slot image, excluding the CRC itself
+static uint16_t  slotCrc(const struct config_slot *s)
+{
+	const uint8_t		*p = (const uint8_t *)s;
+	uint16_t			crc = 0xffff;
+	uint16_t			n;
+
+	for (n=0; n<offsetof(struct config_slot, crc); n++)  crc = _crc_ccitt_update(crc, p[n]);
+	return  crc;
+}
+
+
+
+// load the build-time settings into staged
+static void  loadDefaults(void)
+{
+	staged.version = CONFIG_VERSION;
+	staged.debounce_algorithm = DEBOUNCE_ALGORITHM;
+	staged.debounce_press_ms = DEBOUNCE_PRESS_MS;
+	staged.debounce_release_ms = DEBOUNCE_RELEASE_MS;
+	staged.scan_rate_hz = SCAN_RATE_HZ;
+	staged.scan_phase_us = SCAN_PHASE_US;
+	memcpy_P(staged.keymap, defaultKeymap, sizeof(staged.keymap));
+}
+
+
+
+// read a slot into slotImage; returns non-zero if it holds valid settings
+static uint8_t  readSlot(uint8_t n)
+{
+	uint8_t			*p = (uint8_t *)&slotImage;
+	uint16_t		pos;
+
+	for (pos=0; pos<sizeof(slotImage); pos++)  p[pos] = eeprom_read_byte(SLOT_ADDR(n, pos));
+	return  (slotImage.crc == slotCrc(&slotImage)) && (slotImage.data.version == CONFIG_VERSION);
+}
+
+
+
+/*
+ *  config_init      load the settings from EEPROM, or the defaults
+ *
+ *  default_keymap points to the build-time keymap in program memory, in
+ *  the layout of config.keymap.  Call before usb_init(), so the host
+ *  never sees the settings half loaded.
+ */
+void  config_init(const uint8_t *default_keymap)
+{
+	uint8_t			n;
+	uint8_t			found = 0;
+
+	defaultKeymap = default_keymap;
+	slot = CONFIG_SLOTS - 1;					// so the first save goes to slot 0
+	sequence = 0;
+	for (n=0; n<CONFIG_SLOTS; n++)
+	{
+		if (!readSlot(n))  continue;
+		if (found && (int16_t)(slotImage.sequence - sequence) <= 0)  continue;
+		found = 1;
+		slot = n;
+		sequence = slotImage.sequence;
+	}
+	if (found)
+	{
+		readSlot(slot);
+		staged = slotImage.data;
+		stored = 1;
+	}
+	else
+	{
+		loadDefaults();
+	}
+	config = staged;
+}
+
+
+
+/*
+ *  config_task      carry on with a save; call from the main loop
+ */
+void  config_task(void)
+{
+	uint8_t			*p = (uint8_t *)&slotImage;
+	uint8_t			intr_state;
+
+	if (saveRequested)
+	{
+		intr_state = SREG;
+		cli();
+		saveRequested = 0;
+		slotImage.data = staged;				// a consistent copy, the host may change it
+		modified = 0;
+		SREG = intr_state;
+		if (!saving)							// a save restarted midway rewrites the same slot
+		{
+			slot = (slot + 1) % CONFIG_SLOTS;
+			sequence++;
+		}
+		slotImage.sequence = sequence;
+		slotImage.crc = slotCrc(&slotImage);
+		savePos = 0;
+		saving = 1;
+	}
+	if (!saving)  return;
+	if (!eeprom_is_ready())  return;
+
+	while (savePos < sizeof(slotImage))
+	{
+		if (eeprom_read_byte(SLOT_ADDR(slot, savePos)) != p[savePos])
+		{
+			eeprom_write_byte(SLOT_ADDR(slot, savePos), p[savePos]);
+			savePos++;
+			return;
+		}
+		savePos++;
+	}
+	saving = 0;
+	stored = 1;
+}
+
+
+
+/*
+ *  config_update      take the host's changes into config; call from the main loop
+ *
+ *  Returns non-zero if there were any.  staged is copied without cli,
+ *  over again if the USB interrupt changed it during the copy, so the
+ *  scan never sees a half-written setting and the interrupt is never
+ *  held off for the length of the copy.
+ */
+uint8_t  config_update(void)
+{
+	uint8_t			seq;
+
+	if (!changed)  return  0;
+	changed = 0;
+	do
+	{
+		seq = stagedSeq;
+		__asm__ __volatile__ ("" ::: "memory");	// keep the copy between the two reads
+		config = staged;
+		__asm__ __volatile__ ("" ::: "memory");
+	} while (seq != stagedSeq);
+	return  1;
+}
+
+
+
+/*
+ *  config_get      answer a vendor read request; called from the USB interrupt
+ *
+ *  Fills buf (at least RECORD_READ_SIZE bytes) and returns the number of bytes to send,
+ *  or -1 to stall the request.
+ */
+int8_t  config_get(uint8_t request, uint16_t wValue, uint16_t wIndex, uint8_t *buf)
+{
+	uint8_t			layer = wValue >> 8;
+	uint8_t			row = (wValue >> 4) & 0x0f;
+	uint8_t			col = wValue & 0x0f;
+	uint16_t		v;
+
+	switch (request)
+	{
+		case  CONFIG_GET_KEY:
+		if ((layer >= CONFIG_LAYERS) || (row >= CONFIG_ROWS) || (col >= CONFIG_COLS))  return  -1;
+		buf[0] = staged.keymap[layer][row][col];
+		return  1;
+
+		case  CONFIG_GET_PARAM:
+		switch (wValue)
+		{
+			case  CONFIG_PARAM_SCAN_RATE:	v = staged.scan_rate_hz;  break;
+			case  CONFIG_PARAM_DEBOUNCE:	v = staged.debounce_algorithm;  break;
+			case  CONFIG_PARAM_PRESS_MS:	v = staged.debounce_press_ms;  break;
+			case  CONFIG_PARAM_RELEASE_MS:	v = staged.debounce_release_ms;  break;
+			case  CONFIG_PARAM_SCAN_PHASE:	v = staged.scan_phase_us;  break;
+			default:						return  -1;
+		}
+		buf[0] = v;
+		buf[1] = v >> 8;
+		return  2;
+
+		case  CONFIG_STATUS:
+		buf[0] = ((saving || saveRequested) ? CONFIG_STATUS_SAVING : 0)
+			| (stored ? CONFIG_STATUS_STORED : 0)
+			| (modified ? CONFIG_STATUS_MODIFIED : 0);
+		buf[1] = slot;
+		buf[2] = sequence;
+		buf[3] = sequence >> 8;
+		return  4;
+
+		case  CONFIG_RECORD_READ:
+		return  record_read(buf);
+	}
+	return  -1;
+}
+
+
+
+/*
+ *  config_set      carry out a vendor write request; called from the USB interrupt
+ *
+ *  Returns non-zero if the request was accepted, zero to stall it.
+ */
+uint8_t  config_set(uint8_t request, uint16_t wValue, uint16_t wIndex)
+{
+	uint8_t			layer = wValue >> 8;
+	uint8_t			row = (wValue >> 4) & 0x0f;
+	uint8_t			col = wValue & 0x0f;
+
+	switch (request)
+	{
+		case  CONFIG_SET_KEY:
+		if ((layer >= CONFIG_LAYERS) || (row >= CONFIG_ROWS) || (col >= CONFIG_COLS))  return  0;
+		if (wIndex > 0xff)  return  0;
+		staged.keymap[layer][row][col] = wIndex;
+		break;
+
+		case  CONFIG_SET_PARAM:
+		switch (wValue)
+		{
+			case  CONFIG_PARAM_SCAN_RATE:
+			if ((wIndex < SCAN_RATE_MIN_HZ) || (wIndex > SCAN_RATE_MAX_HZ))  return  0;
+			staged.scan_rate_hz = wIndex;
+			break;
+
+			case  CONFIG_PARAM_DEBOUNCE:
+			if (wIndex > DEBOUNCE_INTEGRATOR)  return  0;
+			staged.debounce_algorithm = wIndex;
+			break;
+
+			case  CONFIG_PARAM_PRESS_MS:
+			if (wIndex > 0xff)  return  0;
+			staged.debounce_press_ms = wIndex;
+			break;
+
+			case  CONFIG_PARAM_RELEASE_MS:
+			if (wIndex > 0xff)  return  0;
+			staged.debounce_release_ms = wIndex;
+			break;
+
+			case  CONFIG_PARAM_SCAN_PHASE:
+			if (wIndex > SCAN_PHASE_MAX_US)  return  0;
+			staged.scan_phase_us = wIndex;
+			break;
+
+			default:
+			return  0;
+		}
+		break;
+
+		case  CONFIG_SAVE:
+		saveRequested = 1;
+		return  1;
+
+		case  CONFIG_DEFAULTS:
+		loadDefaults();
+		break;
+
+		case  CONFIG_RECORD:					// not a setting, leaves modified alone
+		if (wValue > 1)  return  0;
+		if (wValue)  record_start();
+		else  record_stop();
+		return  1;
+
+		default:
+		return  0;
+	}
+	modified = 1;
+	stagedSeq++;
+	changed = 1;
+	return  1;
+}
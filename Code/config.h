@@ -0,0 +1,113 @@
+/*
+ *  config.h
+ *
+ *  Runtime settings for the Vic-20 USB keyboard: the keymap of every
+ *  layer, the scan rate and phase and the debounce algorithm and windows.
+ *
+ *  The settings are kept in RAM in config and read from there by the
+ *  scan; EEPROM is only read once at boot and written when the host asks
+ *  for a save.  The host reads and changes them with vendor requests on
+ *  endpoint 0, handled by config_get() and config_set() from the USB
+ *  interrupt on a copy of their own; config_update() takes the changes
+ *  into config from the main loop before the next scan, so the scan never
+ *  reads a setting half written.  A change is lost at reset unless it is
+ *  saved.  tools/vic20cfg is a command line client.
+ *
+ *  EEPROM holds CONFIG_SLOTS copies of the settings.  Every save goes to
+ *  the slot after the last one written, with a sequence number one
+ *  higher and a CRC over the whole slot, so each slot is rewritten only
+ *  once every CONFIG_SLOTS saves.  At boot the valid slot with the
+ *  highest sequence number is loaded; a slot torn by a reset during a
+ *  save fails its CRC and the previous one is used instead.  With no
+ *  valid slot the build-time defaults apply.
+ *
+ *  This header is shared with the host tools, so it only uses <stdint.h>.
+ */
+
+#ifndef config_h__
+#define config_h__
+
+#include <stdint.h>
+
+#define  CONFIG_LAYERS				3			/* keymap dimensions, as in keyMapping[] */
+#define  CONFIG_ROWS				9
+#define  CONFIG_COLS				8
+
+/*
+ *  Vendor requests, bmRequestType 0xC0 (read) or 0x40 (write), addressed
+ *  to the device.  Key cells are selected by wValue = CONFIG_KEY(layer,
+ *  row, col).  All multi-byte values are little endian.
+ *
+ *  CONFIG_GET_KEY		read		1 byte, the usage or code in the cell
+ *  CONFIG_SET_KEY		write		wIndex is the new code for the cell
+ *  CONFIG_GET_PARAM	read		wValue = CONFIG_PARAM_*, 2 bytes
+ *  CONFIG_SET_PARAM	write		wValue = CONFIG_PARAM_*, wIndex = value
+ *  CONFIG_SAVE			write		start writing the settings to EEPROM
+ *  CONFIG_DEFAULTS		write		go back to the build-time settings
+ *  CONFIG_STATUS		read		4 bytes: CONFIG_STATUS_* flags, the slot
+ *									last loaded or saved and its sequence
+ *									number (valid with CONFIG_STATUS_STORED)
+ *  CONFIG_RECORD		write		wValue = 1 starts recording key edges,
+ *									0 stops it (record.h)
+ *  CONFIG_RECORD_READ	read		up to RECORD_READ_SIZE bytes of recorded
+ *									edges, removed from the recorder
+ *
+ *  Out of range requests are stalled, and so is a write request with a
+ *  data stage (wLength not 0).
+ */
+#define  CONFIG_REQUEST_READ		0xC0
+#define  CONFIG_REQUEST_WRITE		0x40
+
+#define  CONFIG_GET_KEY				0x01
+#define  CONFIG_SET_KEY				0x02
+#define  CONFIG_GET_PARAM			0x03
+#define  CONFIG_SET_PARAM			0x04
+#define  CONFIG_SAVE				0x05
+#define  CONFIG_DEFAULTS			0x06
+#define  CONFIG_STATUS				0x07
+#define  CONFIG_RECORD				0x08
+#define  CONFIG_RECORD_READ			0x09
+
+#define  CONFIG_KEY(layer, row, col)	(((layer) << 8) | ((row) << 4) | (col))
+
+#define  CONFIG_PARAM_SCAN_RATE		0			/* Hz */
+#define  CONFIG_PARAM_DEBOUNCE		1			/* DEBOUNCE_* algorithm */
+#define  CONFIG_PARAM_PRESS_MS		2			/* debounce windows */
+#define  CONFIG_PARAM_RELEASE_MS	3
+#define  CONFIG_PARAM_SCAN_PHASE	4			/* us before start of frame, see timer.h */
+#define  CONFIG_NUM_PARAMS			5
+
+#define  CONFIG_STATUS_SAVING		0x01		/* an EEPROM write is in progress */
+#define  CONFIG_STATUS_STORED		0x02		/* EEPROM holds saved settings */
+#define  CONFIG_STATUS_MODIFIED		0x04		/* changed since the last load or save */
+
+/*
+ *  The settings, as cached in RAM and stored in each EEPROM slot.
+ *  Raise CONFIG_VERSION when the layout changes, so old slots are
+ *  ignored rather than misread.
+ */
+#define  CONFIG_VERSION				2
+
+struct config_data {
+	uint8_t			version;
+	uint8_t			debounce_algorithm;
+	uint8_t			debounce_press_ms;
+	uint8_t			debounce_release_ms;
+	uint16_t		scan_rate_hz;
+	uint16_t		scan_phase_us;
+	uint8_t			keymap[CONFIG_LAYERS][CONFIG_ROWS][CONFIG_COLS];
+};
+
+#define  CONFIG_EEPROM_SIZE			4096		/* at90usb1286 */
+#define  CONFIG_SLOT_SIZE			256
+#define  CONFIG_SLOTS				(CONFIG_EEPROM_SIZE / CONFIG_SLOT_SIZE)
+
+extern struct config_data		config;			// main loop only, see config_update()
+
+void		config_init(const uint8_t *default_keymap);	// keymap in PROGMEM
+void		config_task(void);
+uint8_t		config_update(void);
+int8_t		config_get(uint8_t request, uint16_t wValue, uint16_t wIndex, uint8_t *buf);
+uint8_t		config_set(uint8_t request, uint16_t wValue, uint16_t wIndex);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ *  debounce.c
+ *
+ *  Per-key debounce for the Vic-20 keyboard matrix; see debounce.h.
+ *
+ *  Every key has an 8-bit counter.  For the eager and deferred algorithms
+ *  it counts consecutive samples that disagree with the debounced state
+ *  and is cleared as soon as they agree again; the key changes state when
+ *  the counter reaches the window for that direction (the eager press
+ *  window is always one sample).  After an eager release it instead
+ *  counts down the hold-off, the release window, during which closures
+ *  are ignored.  For the integrator it is the integral itself, clamped to
+ *  0..press window.
+ *
+ *  busy[] has a bit set for every key whose counter is away from its rest
+ *  value, so a row whose raw sample matches its debounced state and has
+ *  no busy keys is skipped with one compare.
+ */
+
+#include <stdint.h>
+#include "debounce.h"
+#include "timer.h"
+
+
+static uint8_t			counter[DEBOUNCE_MAX_ROWS][8];
+static uint8_t			busy[DEBOUNCE_MAX_ROWS];
+static uint8_t			algorithm;
+static uint8_t			pressTicks;
+static uint8_t			releaseTicks;
+
+
+
+// convert a window in milliseconds to scan ticks, at least one
+static uint8_t  msToTicks(uint8_t ms)
+{
+	uint32_t		ticks;
+
+	ticks = ((uint32_t)ms * 1000 + timer_period_us() - 1) / timer_period_us();
+	if (ticks < 1)  ticks = 1;
+	if (ticks > 255)  ticks = 255;
+	return  ticks;
+}
+
+
+
+/*
+ *  debounce_init      reset all keys to released, with the build-time defaults
+ */
+void  debounce_init(void)
+{
+	debounce_configure(DEBOUNCE_ALGORITHM, DEBOUNCE_PRESS_MS, DEBOUNCE_RELEASE_MS);
+}
+
+
+
+/*
+ *  debounce_configure      select the algorithm and its windows
+ *
+ *  All keys are reset to their rest state; the caller should treat the
+ *  matrix as released afterwards.
+ */
+void  debounce_configure(uint8_t alg, uint8_t press_ms, uint8_t release_ms)
+{
+	uint8_t			r, b;
+
+	algorithm = alg;
+	pressTicks = (alg == DEBOUNCE_EAGER) ? 1 : msToTicks(press_ms);
+	releaseTicks = msToTicks(release_ms);
+	for (r=0; r<DEBOUNCE_MAX_ROWS; r++)
+	{
+		busy[r] = 0;
+		for (b=0; b<8; b++)  counter[r][b] = 0;
+	}
+}
+
+
+
+/*
+ *  debounce_update      fold one raw matrix sample into the debounced state
+ *
+ *  prev[] holds the debounced state after the last sample; the new state
+ *  is written to next[], every row of it.  Returns non-zero if any
+ *  debounced bit changed.
+ */
+uint8_t  debounce_update(const uint8_t *raw, const uint8_t *prev, uint8_t *next, uint8_t rows)
+{
+	uint8_t			r, b, bit;
+	uint8_t			diff, work, deb, c;
+	uint8_t			changed = 0;
+
+	if (rows > DEBOUNCE_MAX_ROWS)  rows = DEBOUNCE_MAX_ROWS;
+	for (r=0; r<rows; r++)
+	{
+		deb = prev[r];
+		next[r] = deb;
+		diff = raw[r] ^ deb;
+		work = diff | busy[r];
+		if (work == 0)  continue;			// stable row, nothing pending
+
+		for (b=0, bit=1; b<8; b++, bit<<=1)
+		{
+			if ((work & bit) == 0)  continue;
+			c = counter[r][b];
+			if (algorithm == DEBOUNCE_INTEGRATOR)
+			{
+				if ((raw[r] & bit) == 0)  { if (c < pressTicks)  c++; }	// closed
+				else if (c)  c--;
+				if (c == pressTicks)  deb &= ~bit;
+				else if (c == 0)  deb |= bit;
+				if (((deb & bit) == 0) ? (c != pressTicks) : (c != 0))  busy[r] |= bit;
+				else  busy[r] &= ~bit;
+			}
+			else
+			{
+				if ((algorithm == DEBOUNCE_EAGER) && (deb & bit) && c)  c--;	// hold-off after a release
+				else if ((diff & bit) == 0)  c = 0;		// agrees again, start over
+				else if (++c >= (((deb & bit) == 0) ? releaseTicks : pressTicks))
+				{
+					deb ^= bit;
+					c = ((algorithm == DEBOUNCE_EAGER) && (deb & bit)) ? releaseTicks : 0;
+				}
+				if (c)  busy[r] |= bit;
+				else  busy[r] &= ~bit;
+			}
+			counter[r][b] = c;
+		}
+		if (deb != prev[r])
+		{
+			next[r] = deb;
+			changed = 1;
+		}
+	}
+	return  changed;
+}
@@ -0,0 +1,55 @@
+/*
+ *  debounce.h
+ *
+ *  Per-key debounce for the Vic-20 keyboard matrix.
+ *
+ *  debounce_update() sits between the raw matrix sample taken by
+ *  scanKeyboard() and its change detection.  It reads the debounced state
+ *  of the last scan from one array and writes the new one to another, so
+ *  the caller can alternate between two buffers and compare them for
+ *  edges without copying.  All arrays use the scan's format: one byte per
+ *  strobe line, one bit per sense line, active low (a 0 bit is a closed
+ *  switch).
+ *
+ *  Three algorithms are available, each with millisecond windows that
+ *  are converted to scan ticks at the current scan rate (timer.h), so
+ *  debounce_configure() must be called again after the rate changes:
+ *
+ *  DEBOUNCE_EAGER        a press is reported on the first closed sample;
+ *                        a release only after release_ms of open samples,
+ *                        and closures are then ignored for release_ms
+ *  DEBOUNCE_DEFERRED     a press needs press_ms of closed samples, a
+ *                        release needs release_ms of open samples
+ *  DEBOUNCE_INTEGRATOR   a per-key counter moves up on closed samples and
+ *                        down on open ones; the key reads pressed when it
+ *                        reaches press_ms and released when it is back at 0
+ *
+ *  The build-time defaults below can be overridden with -D in CDEFS.
+ */
+
+#ifndef debounce_h__
+#define debounce_h__
+
+#include <stdint.h>
+
+#define  DEBOUNCE_EAGER				0
+#define  DEBOUNCE_DEFERRED			1
+#define  DEBOUNCE_INTEGRATOR		2
+
+#ifndef  DEBOUNCE_ALGORITHM
+#define  DEBOUNCE_ALGORITHM			DEBOUNCE_EAGER
+#endif
+#ifndef  DEBOUNCE_PRESS_MS
+#define  DEBOUNCE_PRESS_MS			5
+#endif
+#ifndef  DEBOUNCE_RELEASE_MS
+#define  DEBOUNCE_RELEASE_MS		5
+#endif
+
+#define  DEBOUNCE_MAX_ROWS			9			/* strobe lines in the matrix */
+
+void		debounce_init(void);
+void		debounce_configure(uint8_t algorithm, uint8_t press_ms, uint8_t release_ms);
+uint8_t		debounce_update(const uint8_t *raw, const uint8_t *prev, uint8_t *next, uint8_t rows);
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ *  host/avr/eeprom.h
+ *
+ *  Stand-in for <avr/eeprom.h> used by the host-native build.  The
+ *  EEPROM is an array in the simulator (sim_eeprom[]); a write keeps it
+ *  busy for the datasheet's 3.4 ms, and a write issued while it is still
+ *  busy waits for it first, as the avr-libc routines do.
+ */
+
+#ifndef host_avr_eeprom_h__
+#define host_avr_eeprom_h__
+
+#include <stdint.h>
+
+uint8_t		sim_eeprom_read(uint16_t addr);
+void		sim_eeprom_write(uint16_t addr, uint8_t value);
+uint8_t		sim_eeprom_ready(void);
+
+#define eeprom_read_byte(addr)			sim_eeprom_read((uint16_t)(uintptr_t)(addr))
+#define eeprom_write_byte(addr, value)	sim_eeprom_write((uint16_t)(uintptr_t)(addr), (value))
+#define eeprom_update_byte(addr, value)	\
+	do { if (eeprom_read_byte(addr) != (value))  eeprom_write_byte((addr), (value)); } while (0)
+#define eeprom_is_ready()				sim_eeprom_ready()
+#define eeprom_busy_wait()				do {} while (!eeprom_is_ready())
+
+#endif
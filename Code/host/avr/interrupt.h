@@ -0,0 +1,20 @@
+/*
+ *  host/avr/interrupt.h
+ *
+ *  Stand-in for <avr/interrupt.h> used by the host-native build.  An ISR
+ *  becomes an ordinary function that the simulator calls when its
+ *  interrupt is pending and the I bit in SREG is set.
+ */
+
+#ifndef host_avr_interrupt_h__
+#define host_avr_interrupt_h__
+
+#include <avr/io.h>
+
+void		sim_sei(void);
+
+#define ISR(vector, ...)	void vector(void); void vector(void)
+#define sei()				sim_sei()
+#define cli()				(SREG &= (uint8_t)~0x80)
+
+#endif
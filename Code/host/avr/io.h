@@ -0,0 +1,175 @@
+/*
+ *  host/avr/io.h
+ *
+ *  Stand-in for <avr/io.h> used by the host-native build (make host).
+ *
+ *  The firmware sources are compiled unmodified with gcc for Linux; this
+ *  header replaces the at90usb1286 I/O registers they touch with either
+ *  plain variables or calls into the simulator (host/sim.c).  Registers
+ *  with side effects (the sense port, the USB FIFO, the endpoint flags,
+ *  the frame counter) are routed through sim_*() accessors that return
+ *  a pointer, so an access such as "UEDATX = x" still compiles, and the
+ *  simulator gets a chance to advance time and service the simulated
+ *  host on every access.
+ *
+ *  Only the registers and bit names used by the firmware are provided.
+ */
+
+#ifndef host_avr_io_h__
+#define host_avr_io_h__
+
+#include <stdint.h>
+
+#define __AVR_AT90USB1286__		1
+
+/*
+ *  Simulator accessors; see host/sim.c.
+ */
+#define SIM_UECONX			0
+#define SIM_UECFG0X			1
+#define SIM_UECFG1X			2
+#define SIM_UEIENX			3
+#define SIM_UEINTX			4
+#define SIM_NUM_EPREGS		5
+
+#define SIM_PORT_C			0
+#define SIM_PORT_E			1
+#define SIM_PORT_F			2
+
+uint8_t				sim_read_pin(uint8_t port);
+volatile uint8_t	*sim_reg_pllcsr(void);
+volatile uint8_t	*sim_reg_udfnuml(void);
+volatile uint8_t	*sim_reg_uedatx(void);
+volatile uint8_t	*sim_reg_ep(uint8_t reg);
+volatile uint16_t	*sim_reg_tcnt1(void);
+volatile uint8_t	*sim_reg_tifr1(void);
+volatile uint8_t	*sim_reg_udint(void);
+
+/*
+ *  General purpose I/O
+ */
+extern volatile uint8_t		PORTC, DDRC;
+extern volatile uint8_t		PORTD, DDRD;
+extern volatile uint8_t		PORTE, DDRE;
+extern volatile uint8_t		PORTF, DDRF;
+#define PINC				(sim_read_pin(SIM_PORT_C))
+#define PINE				(sim_read_pin(SIM_PORT_E))
+#define PINF				(sim_read_pin(SIM_PORT_F))
+
+/*
+ *  Core
+ */
+extern volatile uint8_t		SREG;
+extern volatile uint8_t		CLKPR;
+extern volatile uint8_t		SMCR;
+
+#define SE					0
+#define SM0					1
+#define SM1					2
+#define SM2					3
+
+/*
+ *  Watchdog, interrupt mode only
+ */
+extern volatile uint8_t		WDTCSR, MCUSR;
+
+#define WDP0				0
+#define WDP1				1
+#define WDP2				2
+#define WDE					3
+#define WDCE				4
+#define WDP3				5
+#define WDIE				6
+#define WDIF				7
+#define WDRF				3
+
+/*
+ *  Timer1
+ */
+extern volatile uint8_t		TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t	OCR1A;
+#define TCNT1				(*sim_reg_tcnt1())
+#define TIFR1				(*sim_reg_tifr1())
+
+#define CS10				0
+#define CS11				1
+#define CS12				2
+#define WGM12				3
+#define WGM13				4
+#define OCIE1A				1
+#define OCF1A				1
+
+/*
+ *  USB controller
+ */
+extern volatile uint8_t		UHWCON, USBCON, UDCON, UDIEN, UDADDR;
+extern volatile uint8_t		UENUM, UERST;
+#define PLLCSR				(*sim_reg_pllcsr())
+#define UDFNUML				(*sim_reg_udfnuml())
+#define UDINT				(*sim_reg_udint())
+#define UEDATX				(*sim_reg_uedatx())
+#define UECONX				(*sim_reg_ep(SIM_UECONX))
+#define UECFG0X				(*sim_reg_ep(SIM_UECFG0X))
+#define UECFG1X				(*sim_reg_ep(SIM_UECFG1X))
+#define UEIENX				(*sim_reg_ep(SIM_UEIENX))
+#define UEINTX				(*sim_reg_ep(SIM_UEINTX))
+
+#define PLOCK				0
+#define PLLE				1
+
+#define FRZCLK				5
+#define OTGPADE				4
+#define USBE				7
+
+#define DETACH				0
+#define RMWKUP				1
+
+#define SUSPI				0
+#define SOFI				2
+#define EORSTI				3
+#define WAKEUPI				4
+#define EORSMI				5
+#define UPRSMI				6
+#define SUSPE				0
+#define SOFE				2
+#define EORSTE				3
+#define WAKEUPE				4
+#define EORSME				5
+#define UPRSME				6
+
+#define ADDEN				7
+
+#define EPEN				0
+#define RSTDT				3
+#define STALLRQC			4
+#define STALLRQ				5
+
+#define ALLOC				1
+
+#define TXINI				0
+#define STALLEDI			1
+#define RXOUTI				2
+#define RXSTPI				3
+#define NAKOUTI				4
+#define RWAL				5
+#define NAKINI				6
+#define FIFOCON				7
+
+#define TXINE				0
+#define STALLEDE			1
+#define RXOUTE				2
+#define RXSTPE				3
+#define NAKOUTE				4
+#define NAKINE				6
+#define FLERRE				7
+
+/*
+ *  Interrupt vectors; ISR() in host/avr/interrupt.h turns these into
+ *  plain functions that the simulator calls.
+ */
+#define USB_GEN_vect		sim_vector_usb_gen
+#define USB_COM_vect		sim_vector_usb_com
+#define TIMER1_COMPA_vect	sim_vector_timer1_compa
+#define WDT_vect			sim_vector_wdt
+
+#endif
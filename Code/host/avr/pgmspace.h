@@ -0,0 +1,25 @@
+/*
+ *  host/avr/pgmspace.h
+ *
+ *  Stand-in for <avr/pgmspace.h> used by the host-native build.  There is
+ *  only one address space on the host, so PROGMEM data is ordinary const
+ *  data and the pgm_read_*() macros are plain dereferences.
+ */
+
+#ifndef host_avr_pgmspace_h__
+#define host_avr_pgmspace_h__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)					(s)
+
+#define pgm_read_byte(addr)		(*(const uint8_t *)(addr))
+#define pgm_read_word(addr)		(*(const uint16_t *)(addr))
+#define pgm_read_dword(addr)	(*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr)		(*(const void * const *)(addr))
+#define memcpy_P(dst, src, n)	memcpy((dst), (src), (n))
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ *  host/avr/sleep.h
+ *
+ *  Stand-in for <avr/sleep.h> used by the host-native build.  sleep_cpu()
+ *  lets simulated time run until an interrupt has been serviced, and the
+ *  simulator counts the cycles spent asleep.
+ */
+
+#ifndef host_avr_sleep_h__
+#define host_avr_sleep_h__
+
+#include <avr/io.h>
+
+void		sim_sleep(void);
+
+#define SLEEP_MODE_IDLE			0
+#define SLEEP_MODE_ADC			(1<<SM0)
+#define SLEEP_MODE_PWR_DOWN		(1<<SM1)
+#define SLEEP_MODE_PWR_SAVE		((1<<SM0) | (1<<SM1))
+#define SLEEP_MODE_STANDBY		((1<<SM1) | (1<<SM2))
+#define SLEEP_MODE_EXT_STANDBY	((1<<SM0) | (1<<SM1) | (1<<SM2))
+
+#define set_sleep_mode(mode)	(SMCR = (SMCR & ~((1<<SM0) | (1<<SM1) | (1<<SM2))) | (mode))
+#define sleep_enable()			(SMCR |= (1<<SE))
+#define sleep_disable()			(SMCR &= ~(1<<SE))
+#define sleep_cpu()				sim_sleep()
+
+#endif
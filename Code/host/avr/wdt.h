@@ -0,0 +1,18 @@
+/*
+ *  host/avr/wdt.h
+ *
+ *  Stand-in for <avr/wdt.h> used by the host-native build.  The
+ *  simulator models the watchdog's interrupt mode only; wdt_reset()
+ *  restarts its period.
+ */
+
+#ifndef host_avr_wdt_h__
+#define host_avr_wdt_h__
+
+#include <avr/io.h>
+
+void		sim_wdt_reset(void);
+
+#define wdt_reset()			sim_wdt_reset()
+
+#endif
@@ -0,0 +1,128 @@
+#!/bin/sh
+#
+#  host/cfgcheck.sh
+#
+#  Runs tools/vic20cfg against the host-native simulation; part of
+#  make host-check.  Every vic20cfg run boots a fresh simulated keyboard
+#  on the same EEPROM image, so the checks also cover loading the saved
+#  settings at power-on.
+#
+#  Usage:  host/cfgcheck.sh simulator vic20cfg
+
+sim=$1
+cfg=$2
+image=$(mktemp)
+trap 'rm -f "$image"' EXIT
+rm -f "$image"								# start out with an erased EEPROM
+failed=0
+
+# check <name> <expected output>, vic20cfg commands on standard input;
+# a matrix directive in $keys is applied as the simulator starts, and
+# its answer kept from vic20cfg
+check() {
+	if [ -n "$keys" ]; then
+		got=$("$cfg" -s "{ echo $keys; cat; } | $sim -i -e $image | sed -u 1d" -b 2>&1)
+	else
+		got=$("$cfg" -s "$sim -i -e $image" -b 2>&1)
+	fi
+	if [ "$got" != "$2" ]; then
+		printf '%s: FAIL\n--- expected\n%s\n--- got\n%s\n' "$1" "$2" "$got"
+		failed=1
+	fi
+}
+
+check "erased EEPROM" "nothing saved, build-time settings at reset
+rate 1000
+0x04" <<END
+status
+get rate
+key 0 2 1
+END
+
+check "unsaved change" "0x05
+nothing saved, build-time settings at reset
+changed since loaded or saved" <<END
+key 0 2 1 0x05
+key 0 2 1
+status
+END
+
+check "unsaved change is lost" "0x04" <<END
+key 0 2 1
+END
+
+check "save" "saved to slot 0, sequence 1
+saved in slot 0, sequence 1" <<END
+key 0 2 1 0x05
+set rate 500
+set debounce integrator
+save
+status
+END
+
+check "saved settings" "saved in slot 0, sequence 1
+0x05
+rate 500
+debounce integrator" <<END
+status
+key 0 2 1
+get rate
+get debounce
+END
+
+check "out of range" "vic20cfg: rate: rejected by the keyboard" <<END
+set rate 20
+END
+
+check "scan phase" "phase 200
+phase 50
+vic20cfg: phase: rejected by the keyboard" <<END
+get phase
+set phase 50
+get phase
+set phase 1000
+END
+
+check "next slot" "saved to slot 1, sequence 2" <<END
+key 0 2 1 0x06
+save
+END
+
+# a torn or corrupted slot fails its CRC, and the one before it is used
+printf '\125' | dd of="$image" bs=1 seek=$((256 + 100)) conv=notrunc 2>/dev/null
+check "corrupted slot" "saved in slot 0, sequence 1
+0x05" <<END
+status
+key 0 2 1
+END
+
+check "defaults" "rate 1000
+0x04
+saved to slot 1, sequence 2" <<END
+defaults
+get rate
+key 0 2 1
+save
+END
+
+# the reset and the read are a frame apart, so one scan is timed in between
+check "latency" "0 reports timed, 0 dropped, 0 over 50 ms
+scan to start of frame: 1 scans, 0 late, slack min 153 us, avg 153 us, max 153 us" <<END
+latency reset
+latency
+END
+
+check "record nothing" "# recorded with vic20cfg record 1" <<END
+record 1
+END
+
+# a key already held when recording starts is logged at the first scan
+keys="down 2 1"
+check "record held key" "# recorded with vic20cfg record 1
+1200.000	down	2 1" <<END
+record 1
+END
+keys=
+
+[ $failed = 0 ] && echo "host/cfgcheck.sh: PASS"
+exit $failed
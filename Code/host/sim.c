@@ -0,0 +1,1318 @@
+/*
+ *  host/sim.c
+ *
+ *  Simulated Teensy++ 2.0 for the host-native build; see host/sim.h.
+ *
+ *  USB device model
+ *  ----------------
+ *  Each endpoint keeps the registers selected through UENUM, an OUT/SETUP
+ *  receive buffer, the bank the firmware is currently filling through
+ *  UEDATX, and a queue of committed IN banks.
+ *
+ *  The firmware writes UEINTX to clear flags ("write 0 to clear").  The
+ *  shim cannot trap that store directly, so every accessor first compares
+ *  each endpoint's UEINTX with the value the simulator last left there;
+ *  any difference is a firmware write, and the bits written as zero are
+ *  cleared.  Clearing TXINI on the control endpoint, or FIFOCON on any
+ *  other IN endpoint, commits the bank being filled.
+ *
+ *  UEDATX reads from the receive buffer while RXSTPI or RXOUTI is set and
+ *  writes to the fill bank otherwise, which is how the firmware uses it.
+ *
+ *  USB host model
+ *  --------------
+ *  The host notices the attach, waits out the 100 ms attach debounce,
+ *  resets the bus for 10 ms, enumerates the device one control transfer
+ *  at a time the way Linux does (below), and from then on reads every
+ *  interrupt IN endpoint once per frame, 100 us after start of frame as
+ *  a real host's periodic schedule would, and runs any control requests
+ *  the driver queues with sim_host_control().  The transactions of a
+ *  control transfer are 20 us apart, about a full packet's bus time, so
+ *  firmware that waits for the host inside an interrupt handler shows up
+ *  in sim_isr_max_cycles.  Beyond such waits that figure only counts
+ *  register accesses (sim.h); it is no bound on the handler's time on the
+ *  AVR.
+ *
+ *  sim_host_suspend() stops the frames; after 3 ms of idle bus SUSPI is
+ *  set.  The bus resumes when the driver calls sim_host_resume(), or
+ *  when the firmware sets RMWKUP with its clock running: WAKEUPI (host
+ *  resume only) at once, then 20 ms of resume signalling, EORSMI, and
+ *  frames again.
+ *
+ *  Enumeration reads the device descriptor at address 0, sets address
+ *  1, reads the device descriptor again, the configuration descriptor
+ *  (its first 9 bytes, then wTotalLength), the language IDs and every
+ *  string the device descriptor names, and selects the configuration.
+ *  Then, for each HID interface, it reads the HID descriptor, sends
+ *  SET_IDLE(0), reads the report descriptor, and for a boot interface
+ *  selects the report protocol; a boot keyboard also gets SET_REPORT
+ *  with its LEDs off.  Every answer is checked as it comes in: lengths
+ *  against what the descriptors claim, the configuration descriptor
+ *  walked to exactly wTotalLength, the endpoints it describes against
+ *  those the firmware allocated, the HID descriptor against its copy in
+ *  the configuration and the report descriptor parsed to its end.  A
+ *  failed check or a stalled request ends the run.
+ *
+ *  Sleep in power-down stops Timer1; only the watchdog, modelled in
+ *  interrupt mode, and the USB wakeup interrupt can end it.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include "sim.h"
+
+
+#define SIM_NUM_EP			7
+#define SIM_ACCESS_CYCLES	1			/* cost charged per shimmed register access */
+#define SIM_XFER_TIMEOUT	(50 * SIM_CYCLES_PER_MS)
+#define SIM_POLL_DELAY		(100 * SIM_CYCLES_PER_US)	/* SOF to interrupt IN token */
+#define SIM_ATTACH_CYCLES	(100 * SIM_CYCLES_PER_MS)	/* attach debounce */
+#define SIM_RESET_CYCLES	(10 * SIM_CYCLES_PER_MS)	/* bus reset signalling */
+#define SIM_XFER_GAP		(20 * SIM_CYCLES_PER_US)	/* between control transactions */
+#define SIM_SUSPEND_IDLE	(3 * SIM_CYCLES_PER_MS)		/* idle bus to SUSPI */
+#define SIM_RESUME_CYCLES	(20 * SIM_CYCLES_PER_MS)	/* host resume signalling */
+#define SIM_WDT_CYCLES		(16 * SIM_CYCLES_PER_MS)	/* watchdog, shortest period */
+
+
+/*
+ *  Register shim storage
+ */
+volatile uint8_t	PORTC, DDRC;
+volatile uint8_t	PORTD, DDRD;
+volatile uint8_t	PORTE, DDRE;
+volatile uint8_t	PORTF, DDRF;
+volatile uint8_t	SREG;
+volatile uint8_t	CLKPR;
+volatile uint8_t	SMCR;
+volatile uint8_t	WDTCSR, MCUSR;
+volatile uint8_t	TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t	OCR1A;
+volatile uint8_t	UHWCON, USBCON, UDCON, UDIEN, UDADDR;
+volatile uint8_t	UENUM, UERST;
+
+static volatile uint8_t		pllcsr;
+static volatile uint8_t		udfnuml;
+static volatile uint16_t	tcnt1;
+static volatile uint8_t		tifr1;
+static uint8_t				udint;				// device interrupt flags
+static volatile uint8_t		udint_reg;			// as the firmware last saw and wrote them
+static uint8_t				udint_shown;
+
+
+/*
+ *  Interrupt vectors provided by the firmware.  They are weak so that
+ *  the simulator links whichever subset the firmware implements.
+ */
+void	sim_vector_usb_gen(void) __attribute__((weak));
+void	sim_vector_usb_com(void) __attribute__((weak));
+void	sim_vector_timer1_compa(void) __attribute__((weak));
+void	sim_vector_wdt(void) __attribute__((weak));
+
+
+/*
+ *  Simulator state
+ */
+uint64_t			sim_cycles;
+uint8_t				sim_matrix[SIM_NUM_LINES];
+uint64_t			sim_settle_cycles = 2 * SIM_CYCLES_PER_US;
+void				(*sim_on_time)(void);
+void				(*sim_on_report)(uint8_t ep, const uint8_t *data, uint8_t len);
+void				(*sim_on_control)(const uint8_t *setup, int len, const uint8_t *data);
+uint64_t			sim_wakeup = UINT64_MAX;
+uint64_t			sim_sleep_cycles;
+uint64_t			sim_power_down_cycles;
+uint64_t			sim_isr_max_cycles[SIM_NUM_VECTORS];
+uint64_t			sim_suspended_cycles;
+unsigned			sim_remote_wakeups;
+unsigned long		sim_scans;
+uint64_t			sim_isr_total_cycles[SIM_NUM_VECTORS];
+unsigned			sim_isr_count[SIM_NUM_VECTORS];
+uint64_t			sim_enum_cycles;
+unsigned			sim_enum_transfers;
+unsigned			sim_control_transfers;
+uint8_t				sim_eeprom[SIM_EEPROM_SIZE] = { [0 ... SIM_EEPROM_SIZE-1] = 0xff };
+unsigned			sim_eeprom_writes;
+
+static uint64_t		next_frame = SIM_CYCLES_PER_FRAME;
+static uint64_t		next_poll;				// interrupt IN tokens of this frame, 0 if none
+static uint64_t		poll_paused_until;		// see sim_host_pause()
+static uint16_t		frame_number;
+static unsigned		isr_count;
+static uint8_t		in_isr;
+static uint64_t		eeprom_busy_until;
+static uint64_t		wdt_next;				// cycle of the next watchdog interrupt, 0 if off
+
+/*
+ *  Matrix lines.  The sense port follows a change of the lines driven low
+ *  only after sim_settle_cycles; until then it still shows the lines that
+ *  were driven before.
+ */
+static uint16_t		lines_now, lines_before;
+static uint64_t		lines_changed;
+
+/*
+ *  Timer1, CTC mode only: the counter runs from 0 to OCR1A and sets
+ *  OCF1A each time it wraps.  A new OCR1A takes effect at once, without
+ *  restarting the count; if the count is already past it, it runs on to
+ *  0xFFFF first.  A write to TCNT1 moves the count.
+ */
+static const uint16_t	t1_div[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+static uint8_t			t1_cs;
+static uint16_t			t1_top;
+static uint64_t			t1_start;				// cycle the count was last 0
+static uint16_t			tcnt1_shown;			// TCNT1 as last read
+static uint64_t			t1_next;				// cycle of the next compare match, 0 if stopped
+
+struct sim_ep {
+	volatile uint8_t	reg[SIM_NUM_EPREGS];
+	uint8_t				shadow;				// UEINTX as last left by the simulator
+	uint8_t				alloc;
+	uint8_t				cfg1;				// UECFG1X the endpoint was allocated with
+	uint8_t				rx[64];
+	uint8_t				rxlen, rxpos;
+	uint8_t				fill[64];
+	uint8_t				filllen;
+	uint8_t				bank[2][64];
+	uint8_t				banklen[2];
+	uint8_t				bankhead, bankcount;
+};
+static struct sim_ep		ep[SIM_NUM_EP];
+
+enum {
+	HOST_DETACHED,
+	HOST_RESET,
+	HOST_ENUMERATING,
+	HOST_CONFIGURED,
+	HOST_FAILED
+};
+
+enum {
+	XFER_IDLE,
+	XFER_SETUP,
+	XFER_DATA_IN,
+	XFER_DATA_OUT,
+	XFER_STATUS_IN
+};
+
+#define SIM_CONTROL_QUEUE	8
+
+static struct {
+	uint8_t		setup[8];
+	uint8_t		data[64];
+} control_queue[SIM_CONTROL_QUEUE];
+static uint8_t		control_head, control_count;
+
+enum {
+	BUS_ACTIVE,
+	BUS_SUSPENDING,							// frames stopped, SUSPI not yet set
+	BUS_SUSPENDED,
+	BUS_RESUMING
+};
+
+static struct {
+	uint8_t		state;
+	uint8_t		bus;
+	uint64_t	bus_at;						// next bus state change
+	uint64_t	suspended_at;
+	uint8_t		step;
+	uint8_t		sub;						// string or interface of the step
+	uint64_t	reset_at;
+	uint64_t	enum_started;
+	unsigned	enum_transfers;
+	uint8_t		enum_setup[8];				// the next enumeration request
+	uint8_t		phase;
+	uint8_t		setup[8];
+	uint8_t		data[256];
+	uint16_t	len;
+	uint64_t	started;
+	uint64_t	next_at;					// earliest time for the next transaction
+} host;
+
+/*
+ *  Enumeration steps, in order.  The steps from ENUM_HID_DESC on are
+ *  run once for each HID interface.
+ */
+enum {
+	ENUM_DEVICE_FIRST,						// at address 0
+	ENUM_ADDRESS,
+	ENUM_DEVICE,
+	ENUM_CONFIG_HEAD,
+	ENUM_CONFIG,
+	ENUM_LANGIDS,
+	ENUM_STRING,							// sub: iManufacturer, iProduct, iSerialNumber
+	ENUM_SET_CONFIG,
+	ENUM_HID_DESC,							// sub: HID interface
+	ENUM_SET_IDLE,
+	ENUM_REPORT_DESC,
+	ENUM_SET_PROTOCOL,
+	ENUM_SET_LEDS,
+	ENUM_DONE
+};
+
+#define SIM_MAX_HID			4
+#define SIM_MAX_ENDPOINTS	8
+
+// what enumeration has learned of the device so far
+static struct {
+	uint8_t		device[18];
+	uint8_t		config[256];
+	uint16_t	total;						// wTotalLength
+	uint16_t	langid;
+	uint8_t		num_hid;
+	struct {
+		uint8_t		iface;
+		uint8_t		boot;					// bInterfaceProtocol of a boot interface, else 0
+		uint8_t		desc[9];				// as found in the configuration descriptor
+	} hid[SIM_MAX_HID];
+	uint8_t		num_ep;
+	const uint8_t	*ep[SIM_MAX_ENDPOINTS];	// endpoint descriptors in config[]
+} dev;
+
+
+static void		sim_sync(void);
+static void		host_service(void);
+static void		sim_access(void);
+static void		xfer_start(const uint8_t *setup);
+
+
+
+/*
+ *  Endpoint helpers
+ */
+static uint8_t  ep_size(struct sim_ep *p)
+{
+	return 8 << ((p->cfg1 >> 4) & 7);
+}
+
+static uint8_t  ep_banks(struct sim_ep *p)
+{
+	return (p->cfg1 & 0x0c) ? 2 : 1;
+}
+
+static uint8_t  ep_is_in(uint8_t e)
+{
+	return e && (ep[e].reg[SIM_UECFG0X] & 1);
+}
+
+// recompute the hardware-owned UEINTX bits after a state change
+static void  ep_update(uint8_t e)
+{
+	struct sim_ep	*p = &ep[e];
+	uint8_t			v = p->reg[SIM_UEINTX];
+
+	if (p->alloc) {
+		if (e == 0) {
+			if (!(v & (1<<RXSTPI)) && p->bankcount == 0) v |= (1<<TXINI);
+		} else if (ep_is_in(e)) {
+			if (p->bankcount < ep_banks(p)) v |= (1<<FIFOCON) | (1<<RWAL) | (1<<TXINI);
+			else v &= ~(1<<RWAL);
+		}
+	}
+	p->reg[SIM_UEINTX] = v;
+	p->shadow = v;
+}
+
+static void  ep_commit(struct sim_ep *p)
+{
+	uint8_t		slot;
+
+	if (p->bankcount < 2) {
+		slot = (p->bankhead + p->bankcount) & 1;
+		memcpy(p->bank[slot], p->fill, p->filllen);
+		p->banklen[slot] = p->filllen;
+		p->bankcount++;
+	}
+	p->filllen = 0;
+}
+
+// pop the oldest committed IN bank; returns its length, or -1 if none
+static int  ep_take(uint8_t e, uint8_t *buf)
+{
+	struct sim_ep	*p = &ep[e];
+	int				len;
+
+	sim_sync();
+	if (!p->bankcount) return -1;
+	len = p->banklen[p->bankhead];
+	memcpy(buf, p->bank[p->bankhead], len);
+	p->bankhead ^= 1;
+	p->bankcount--;
+	ep_update(e);
+	return len;
+}
+
+static void  ep_sync(uint8_t e)
+{
+	struct sim_ep	*p = &ep[e];
+	uint8_t			v, nv, cleared;
+
+	if ((p->reg[SIM_UECONX] & (1<<EPEN)) && (p->reg[SIM_UECFG1X] & (1<<ALLOC))) {
+		if (!p->alloc || p->cfg1 != p->reg[SIM_UECFG1X]) {
+			p->alloc = 1;
+			p->cfg1 = p->reg[SIM_UECFG1X];
+			p->rxlen = p->rxpos = p->filllen = 0;
+			p->bankhead = p->bankcount = 0;
+			p->reg[SIM_UEINTX] = 0;
+			ep_update(e);
+			return;
+		}
+	} else {
+		p->alloc = 0;
+	}
+
+	v = p->reg[SIM_UEINTX];
+	if (v == p->shadow) return;
+	nv = p->shadow & (v | (1<<RWAL));			// RWAL is read-only
+	cleared = p->shadow & ~nv;
+	p->reg[SIM_UEINTX] = nv;
+	if (e == 0) {
+		if (cleared & (1<<RXSTPI)) p->rxlen = p->rxpos = 0;
+		if (cleared & (1<<TXINI)) ep_commit(p);
+	} else if (cleared & (1<<FIFOCON)) {
+		if (ep_is_in(e)) ep_commit(p);
+		else p->rxlen = p->rxpos = 0;
+	}
+	ep_update(e);
+}
+
+/*
+ *  Timer1 helpers
+ */
+static uint64_t  t1_period(void)
+{
+	return (uint64_t)(t1_top + 1) * t1_div[t1_cs];
+}
+
+static uint16_t  t1_count(void)
+{
+	return t1_div[t1_cs] ? ((sim_cycles - t1_start) / t1_div[t1_cs]) & 0xffff : 0;
+}
+
+static void  timer1_sync(void)
+{
+	if ((TCCR1B & 7) != t1_cs) {
+		t1_cs = TCCR1B & 7;
+		t1_top = OCR1A;
+		t1_start = sim_cycles;
+		t1_next = t1_div[t1_cs] ? t1_start + t1_period() : 0;
+		tcnt1 = tcnt1_shown = 0;
+		return;
+	}
+	if (!t1_div[t1_cs] || !t1_next) return;	// stopped, or frozen in power-down
+	if (tcnt1 != tcnt1_shown) {
+		t1_start = sim_cycles - (uint64_t)tcnt1 * t1_div[t1_cs];
+		tcnt1_shown = tcnt1;
+		t1_top = ~OCR1A;						// recompute the next match below
+	}
+	if (OCR1A != t1_top) {
+		t1_top = OCR1A;
+		t1_next = t1_start + t1_period();
+		if (t1_next <= sim_cycles) t1_next = t1_start + ((uint64_t)0x10000 + t1_top + 1) * t1_div[t1_cs];
+	}
+}
+
+/*
+ *  UDINT flags are cleared by writing 0; writing 1 leaves them alone
+ */
+static void  udint_sync(void)
+{
+	udint &= ~(udint_shown & ~udint_reg);
+	udint_shown = udint_reg = udint;
+}
+
+/*
+ *  Watchdog, interrupt mode: WDIF every 16 ms << WDP while WDIE is set
+ */
+static uint64_t  wdt_period(void)
+{
+	uint8_t		wdp = (WDTCSR & 7) | ((WDTCSR & (1<<WDP3)) ? 8 : 0);
+
+	return (uint64_t)SIM_WDT_CYCLES << wdp;
+}
+
+static void  wdt_sync(void)
+{
+	if (!(WDTCSR & (1<<WDIE))) wdt_next = 0;
+	else if (!wdt_next) wdt_next = sim_cycles + wdt_period();
+}
+
+void  sim_wdt_reset(void)
+{
+	sim_access();
+	if (wdt_next) wdt_next = sim_cycles + wdt_period();
+}
+
+// matrix lines currently driven low
+static uint16_t  driven_lines(void)
+{
+	uint16_t	low = (DDRF & ~PORTF) & 0xff;
+
+	if ((DDRE & (1<<0)) && !(PORTE & (1<<0))) low |= 1 << 8;
+	return low;
+}
+
+// matrix lines the sense port sees as low right now
+static uint16_t  settled_lines(void)
+{
+	return (sim_cycles - lines_changed < sim_settle_cycles) ? lines_before : lines_now;
+}
+
+static void  lines_sync(void)
+{
+	uint16_t	low = driven_lines();
+
+	if (low == lines_now) return;
+	lines_before = settled_lines();
+	lines_now = low;
+	lines_changed = sim_cycles;
+}
+
+static void  sim_sync(void)
+{
+	uint8_t		e;
+
+	for (e=0; e<SIM_NUM_EP; e++) ep_sync(e);
+	timer1_sync();
+	wdt_sync();
+	udint_sync();
+	lines_sync();
+}
+
+
+
+/*
+ *  Interrupt dispatch
+ */
+static uint8_t  com_pending(void)
+{
+	uint8_t		e;
+
+	for (e=0; e<SIM_NUM_EP; e++) {
+		if (ep[e].reg[SIM_UEINTX] & ep[e].reg[SIM_UEIENX] & 0x5f) return 1;
+	}
+	return 0;
+}
+
+static void  run_isr(void (*isr)(void), uint8_t vector)
+{
+	uint8_t		sreg = SREG;
+	uint64_t	start = sim_cycles;
+
+	SREG = sreg & ~0x80;
+	isr_count++;
+	in_isr++;
+	isr();
+	in_isr--;
+	SREG = sreg | 0x80;							// reti
+	if (sim_cycles - start > sim_isr_max_cycles[vector]) sim_isr_max_cycles[vector] = sim_cycles - start;
+	sim_isr_total_cycles[vector] += sim_cycles - start;
+	sim_isr_count[vector]++;
+}
+
+static void  dispatch(void)
+{
+	uint8_t		n;
+
+	for (n=0; n<16; n++) {
+		if (!(SREG & 0x80)) return;
+		sim_sync();								// flags the last handler cleared
+		if ((udint & UDIEN) && sim_vector_usb_gen) run_isr(sim_vector_usb_gen, SIM_VECTOR_USB_GEN);
+		else if (com_pending() && sim_vector_usb_com) run_isr(sim_vector_usb_com, SIM_VECTOR_USB_COM);
+		else if ((TIMSK1 & (1<<OCIE1A)) && (tifr1 & (1<<OCF1A)) && sim_vector_timer1_compa) {
+			tifr1 &= ~(1<<OCF1A);
+			run_isr(sim_vector_timer1_compa, SIM_VECTOR_TIMER1_COMPA);
+		}
+		else if ((WDTCSR & (1<<WDIE)) && (WDTCSR & (1<<WDIF)) && sim_vector_wdt) {
+			WDTCSR &= ~(1<<WDIF);
+			run_isr(sim_vector_wdt, SIM_VECTOR_WDT);
+		}
+		else return;
+	}
+}
+
+
+
+/*
+ *  Time
+ */
+static void  frame(void)
+{
+	next_frame += SIM_CYCLES_PER_FRAME;
+	if (host.state == HOST_DETACHED || host.state == HOST_RESET || host.bus != BUS_ACTIVE) return;
+	frame_number = (frame_number + 1) & 0x7ff;
+	udfnuml = frame_number & 0xff;
+	udint |= (1<<SOFI);
+	if (host.state == HOST_CONFIGURED) next_poll = sim_cycles + SIM_POLL_DELAY;
+}
+
+// the host's interrupt IN tokens, a little after start of frame
+static void  poll(void)
+{
+	uint8_t		e, buf[64];
+	int			len;
+
+	next_poll = 0;
+	if (host.state != HOST_CONFIGURED) return;
+	if (sim_cycles < poll_paused_until) return;
+	for (e=1; e<SIM_NUM_EP; e++) {
+		if (!ep[e].alloc || !ep_is_in(e)) continue;
+		len = ep_take(e, buf);
+		if (len >= 0 && sim_on_report) sim_on_report(e, buf, len);
+	}
+}
+
+// time of the next frame, timer or driver event
+static uint64_t  next_event(void)
+{
+	uint64_t	next = next_frame;
+
+	if (next_poll && next_poll < next) next = next_poll;
+	if (t1_next && t1_next < next) next = t1_next;
+	if (wdt_next && wdt_next < next) next = wdt_next;
+	if (host.bus != BUS_ACTIVE && host.bus_at > sim_cycles && host.bus_at < next) next = host.bus_at;
+	if (host.phase != XFER_IDLE && host.next_at > sim_cycles && host.next_at < next) next = host.next_at;
+	if (sim_wakeup > sim_cycles && sim_wakeup < next) next = sim_wakeup;
+	return next;
+}
+
+void  sim_advance(uint64_t cycles)
+{
+	uint64_t	target = sim_cycles + cycles;
+	uint64_t	next;
+
+	sim_sync();
+	do {
+		next = next_event();
+		if (target < next) next = target;
+		if (next > sim_cycles) sim_cycles = next;
+		if (sim_cycles >= next_frame) frame();
+		if (next_poll && sim_cycles >= next_poll) poll();
+		if (t1_next && sim_cycles >= t1_next) {
+			tifr1 |= (1<<OCF1A);
+			t1_start = t1_next;
+			t1_next += t1_period();
+		}
+		if (wdt_next && sim_cycles >= wdt_next) {
+			WDTCSR |= (1<<WDIF);
+			wdt_next += wdt_period();
+		}
+		if (sim_on_time) sim_on_time();
+		host_service();
+		dispatch();
+	} while (sim_cycles < target);
+}
+
+static void  sim_access(void)
+{
+	sim_advance(SIM_ACCESS_CYCLES);
+}
+
+void  sim_delay_us(double us)
+{
+	sim_advance((uint64_t)(us * SIM_CYCLES_PER_US + 0.5));
+}
+
+void  sim_sleep(void)
+{
+	unsigned	n = isr_count;
+	uint64_t	start = sim_cycles;
+	uint64_t	t1_stopped = 0;
+	uint8_t		power_down;
+
+	if (!(SMCR & (1<<SE))) return;
+	if (!(SREG & 0x80)) {
+		fprintf(stderr, "sim: sleeping with interrupts disabled\n");
+		exit(2);
+	}
+	power_down = (SMCR & ((1<<SM0) | (1<<SM1) | (1<<SM2))) == (1<<SM1);
+	if (power_down) {
+		sim_sync();
+		t1_stopped = t1_next;				// no I/O clock, Timer1 stands still
+		t1_next = 0;
+	}
+	while (isr_count == n) {
+		sim_advance(next_event() > sim_cycles ? next_event() - sim_cycles : 1);
+	}
+	sim_sleep_cycles += sim_cycles - start;
+	if (power_down) {
+		sim_power_down_cycles += sim_cycles - start;
+		if (t1_stopped) {
+			t1_next = t1_stopped + (sim_cycles - start);
+			t1_start += sim_cycles - start;
+		}
+	}
+}
+
+void  sim_sei(void)
+{
+	SREG |= 0x80;
+	sim_advance(0);
+}
+
+
+
+/*
+ *  Register accessors used by host/avr/io.h
+ */
+uint8_t  sim_read_pin(uint8_t port)
+{
+	uint8_t		r, low;
+	uint16_t	lines, reached;
+
+	sim_access();
+	switch (port) {
+		case  SIM_PORT_C:
+		low = 0;
+		lines = settled_lines();
+		if (lines == 1) sim_scans++;		// a scan reads the first line alone once
+		do {								// follow the closed switches, see sim.h
+			reached = lines;
+			for (r=0; r<SIM_NUM_LINES; r++) {
+				if (lines & (1<<r)) low |= sim_matrix[r];
+			}
+			for (r=0; r<SIM_NUM_LINES; r++) {
+				if (sim_matrix[r] & low) lines |= 1 << r;
+			}
+		} while (lines != reached);
+		return (~low & ~DDRC) | (PORTC & DDRC);
+
+		case  SIM_PORT_E:
+		return PORTE;
+
+		case  SIM_PORT_F:
+		return PORTF;
+	}
+	return 0xff;
+}
+
+volatile uint8_t  *sim_reg_pllcsr(void)
+{
+	sim_access();
+	if (pllcsr & (1<<PLLE)) pllcsr |= (1<<PLOCK);
+	return &pllcsr;
+}
+
+volatile uint8_t  *sim_reg_udfnuml(void)
+{
+	sim_access();
+	return &udfnuml;
+}
+
+volatile uint16_t  *sim_reg_tcnt1(void)
+{
+	sim_access();
+	tcnt1 = tcnt1_shown = t1_count();
+	return &tcnt1;
+}
+
+volatile uint8_t  *sim_reg_tifr1(void)
+{
+	sim_access();
+	return &tifr1;
+}
+
+volatile uint8_t  *sim_reg_udint(void)
+{
+	sim_access();
+	udint_sync();
+	return &udint_reg;
+}
+
+volatile uint8_t  *sim_reg_uedatx(void)
+{
+	static uint8_t		scratch;
+	struct sim_ep		*p;
+
+	sim_access();
+	p = &ep[UENUM % SIM_NUM_EP];
+	if (p->reg[SIM_UEINTX] & ((1<<RXSTPI) | (1<<RXOUTI))) {
+		scratch = (p->rxpos < p->rxlen) ? p->rx[p->rxpos] : 0;
+		p->rxpos++;
+		return &scratch;
+	}
+	if (p->filllen < sizeof(p->fill)) return &p->fill[p->filllen++];
+	return &scratch;
+}
+
+volatile uint8_t  *sim_reg_ep(uint8_t reg)
+{
+	sim_access();
+	return &ep[UENUM % SIM_NUM_EP].reg[reg];
+}
+
+
+
+/*
+ *  EEPROM, used through host/avr/eeprom.h
+ */
+uint8_t  sim_eeprom_ready(void)
+{
+	sim_access();
+	return sim_cycles >= eeprom_busy_until;
+}
+
+// the avr-libc routines wait for a write in progress to finish
+static void  eeprom_wait(void)
+{
+	if (!sim_eeprom_ready()) sim_advance(eeprom_busy_until - sim_cycles);
+}
+
+uint8_t  sim_eeprom_read(uint16_t addr)
+{
+	eeprom_wait();
+	return sim_eeprom[addr % SIM_EEPROM_SIZE];
+}
+
+void  sim_eeprom_write(uint16_t addr, uint8_t value)
+{
+	eeprom_wait();
+	sim_eeprom[addr % SIM_EEPROM_SIZE] = value;
+	sim_eeprom_writes++;
+	eeprom_busy_until = sim_cycles + SIM_EEPROM_WRITE_CYCLES;
+}
+
+
+
+/*
+ *  USB host model
+ */
+static void  xfer_start(const uint8_t *setup)
+{
+	struct sim_ep	*p = &ep[0];
+
+	memcpy(host.setup, setup, 8);
+	host.len = 0;
+	host.phase = XFER_SETUP;
+	host.started = sim_cycles;
+	host.next_at = sim_cycles + SIM_XFER_GAP;
+	sim_sync();
+	memcpy(p->rx, setup, 8);
+	p->rxlen = 8;
+	p->rxpos = 0;
+	p->filllen = 0;
+	p->bankcount = 0;
+	p->reg[SIM_UECONX] &= ~(1<<STALLRQ);
+	p->reg[SIM_UEINTX] = (p->reg[SIM_UEINTX] | (1<<RXSTPI)) & ~(1<<TXINI);
+	p->shadow = p->reg[SIM_UEINTX];
+}
+
+// advance the current control transfer; returns 1 when it has finished
+static uint8_t  xfer_service(void)
+{
+	struct sim_ep	*p = &ep[0];
+	uint16_t		wLength = host.setup[6] | (host.setup[7] << 8);
+	uint8_t			buf[64];
+	int				len;
+
+	sim_sync();
+	if (p->reg[SIM_UECONX] & (1<<STALLRQ)) {
+		if (host.state != HOST_CONFIGURED) {
+			fprintf(stderr, "sim: control request %02x/%02x stalled\n", host.setup[0], host.setup[1]);
+		}
+		host.state = HOST_FAILED;
+		host.phase = XFER_IDLE;
+		return 1;
+	}
+	if (sim_cycles - host.started > SIM_XFER_TIMEOUT) {
+		fprintf(stderr, "sim: control request %02x/%02x timed out\n", host.setup[0], host.setup[1]);
+		host.state = HOST_FAILED;
+		host.phase = XFER_IDLE;
+		return 1;
+	}
+	if (sim_cycles < host.next_at) return 0;
+	switch (host.phase) {
+		case  XFER_SETUP:
+		if (p->reg[SIM_UEINTX] & (1<<RXSTPI)) return 0;
+		if (host.setup[0] & 0x80) host.phase = XFER_DATA_IN;
+		else if (wLength) host.phase = XFER_DATA_OUT;
+		else host.phase = XFER_STATUS_IN;
+		host.next_at = sim_cycles + SIM_XFER_GAP;
+		return 0;
+
+		case  XFER_DATA_IN:
+		len = ep_take(0, buf);
+		if (len < 0) return 0;
+		if (host.len + len <= sizeof(host.data)) memcpy(host.data + host.len, buf, len);
+		host.len += len;
+		host.next_at = sim_cycles + SIM_XFER_GAP;
+		if (len < ep_size(p) || host.len >= wLength) {
+			p->reg[SIM_UEINTX] |= (1<<RXOUTI);		// zero-length status OUT
+			p->rxlen = p->rxpos = 0;
+			p->shadow = p->reg[SIM_UEINTX];
+			host.phase = XFER_IDLE;
+			return 1;
+		}
+		return 0;
+
+		case  XFER_DATA_OUT:
+		if (p->reg[SIM_UEINTX] & (1<<RXOUTI)) return 0;
+		if (host.len >= wLength) {
+			host.phase = XFER_STATUS_IN;
+			return 0;
+		}
+		len = wLength - host.len;
+		if (len > ep_size(p)) len = ep_size(p);
+		memcpy(p->rx, host.data + host.len, len);
+		p->rxlen = len;
+		p->rxpos = 0;
+		host.len += len;
+		p->reg[SIM_UEINTX] |= (1<<RXOUTI);
+		p->shadow = p->reg[SIM_UEINTX];
+		host.next_at = sim_cycles + SIM_XFER_GAP;
+		return 0;
+
+		case  XFER_STATUS_IN:
+		if (ep_take(0, buf) < 0) return 0;
+		host.phase = XFER_IDLE;
+		return 1;
+	}
+	return 1;
+}
+
+static void  setup_packet(uint8_t *setup, uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length)
+{
+	setup[0] = type;
+	setup[1] = request;
+	setup[2] = value;
+	setup[3] = value >> 8;
+	setup[4] = index;
+	setup[5] = index >> 8;
+	setup[6] = length;
+	setup[7] = length >> 8;
+}
+
+// end the enumeration over a bad answer
+static void  enum_fail(const char *format, ...)
+{
+	va_list		args;
+
+	fprintf(stderr, "sim: ");
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+	host.state = HOST_FAILED;
+}
+
+// the request of the current enumeration step; returns 0 if it has none
+static uint8_t  enum_request(uint8_t *setup)
+{
+	uint8_t		iface = dev.hid[host.sub].iface;
+	uint8_t		*hid = dev.hid[host.sub].desc;
+
+	switch (host.step) {
+		case  ENUM_DEVICE_FIRST:
+		setup_packet(setup, 0x80, 6, 0x0100, 0, 64);
+		return 1;
+
+		case  ENUM_ADDRESS:
+		setup_packet(setup, 0x00, 5, 1, 0, 0);
+		return 1;
+
+		case  ENUM_DEVICE:
+		setup_packet(setup, 0x80, 6, 0x0100, 0, 18);
+		return 1;
+
+		case  ENUM_CONFIG_HEAD:
+		setup_packet(setup, 0x80, 6, 0x0200, 0, 9);
+		return 1;
+
+		case  ENUM_CONFIG:
+		setup_packet(setup, 0x80, 6, 0x0200, 0, dev.total);
+		return 1;
+
+		case  ENUM_LANGIDS:
+		if (!dev.device[14] && !dev.device[15] && !dev.device[16]) return 0;
+		setup_packet(setup, 0x80, 6, 0x0300, 0, 255);
+		return 1;
+
+		case  ENUM_STRING:
+		if (!dev.device[14 + host.sub]) return 0;
+		setup_packet(setup, 0x80, 6, 0x0300 | dev.device[14 + host.sub], dev.langid, 255);
+		return 1;
+
+		case  ENUM_SET_CONFIG:
+		setup_packet(setup, 0x00, 9, dev.config[5], 0, 0);
+		return 1;
+
+		case  ENUM_HID_DESC:
+		setup_packet(setup, 0x81, 6, 0x2100, iface, 9);
+		return 1;
+
+		case  ENUM_SET_IDLE:
+		setup_packet(setup, 0x21, 0x0a, 0, iface, 0);
+		return 1;
+
+		case  ENUM_REPORT_DESC:
+		setup_packet(setup, 0x81, 6, 0x2200, iface, hid[7] | (hid[8] << 8));
+		return 1;
+
+		case  ENUM_SET_PROTOCOL:
+		if (!dev.hid[host.sub].boot) return 0;
+		setup_packet(setup, 0x21, 0x0b, 1, iface, 0);
+		return 1;
+
+		case  ENUM_SET_LEDS:
+		if (dev.hid[host.sub].boot != 1) return 0;
+		setup_packet(setup, 0x21, 0x09, 0x0200, iface, 1);
+		return 1;
+	}
+	return 0;
+}
+
+static void  enum_next(void)
+{
+	if (host.step == ENUM_STRING && ++host.sub < 3) return;
+	if (host.step == ENUM_SET_LEDS && ++host.sub < dev.num_hid) {
+		host.step = ENUM_HID_DESC;
+		return;
+	}
+	host.step++;
+	if (host.step == ENUM_STRING || host.step == ENUM_HID_DESC) host.sub = 0;
+	if (host.step == ENUM_HID_DESC && !dev.num_hid) host.step = ENUM_DONE;
+}
+
+// move on to the next step with a request; the enumeration is over at ENUM_DONE
+static void  enum_skip(void)
+{
+	while (host.step != ENUM_DONE && !enum_request(host.enum_setup)) enum_next();
+	if (host.step != ENUM_DONE) return;
+	host.state = HOST_CONFIGURED;
+	sim_enum_cycles = sim_cycles - host.enum_started;
+	sim_enum_transfers = host.enum_transfers;
+}
+
+// walk the configuration descriptor and note its HID interfaces and endpoints
+static void  config_walk(void)
+{
+	const uint8_t	*c = dev.config;
+	uint16_t		pos;
+	uint8_t			interfaces = 0, endpoints = 0, iface = 0, class = 0, subclass = 0, protocol = 0;
+
+	dev.num_hid = dev.num_ep = 0;
+	for (pos=0; pos<dev.total; pos+=c[pos]) {
+		if (c[pos] < 2 || pos + c[pos] > dev.total) {
+			enum_fail("configuration descriptor: the one at offset %u runs past wTotalLength %u", pos, dev.total);
+			return;
+		}
+		switch (c[pos + 1]) {
+			case  2:
+			if (pos) enum_fail("configuration descriptor: another one at offset %u", pos);
+			break;
+
+			case  4:
+			if (c[pos] < 9 || endpoints) {
+				enum_fail("configuration descriptor: bad interface descriptor at offset %u", pos);
+				return;
+			}
+			if (c[pos + 3] == 0) interfaces++;
+			iface = c[pos + 2];
+			endpoints = c[pos + 4];
+			class = c[pos + 5];
+			subclass = c[pos + 6];
+			protocol = c[pos + 7];
+			break;
+
+			case  0x21:
+			if (c[pos] < 9 || class != 3 || dev.num_hid == SIM_MAX_HID) {
+				enum_fail("configuration descriptor: bad HID descriptor at offset %u", pos);
+				return;
+			}
+			dev.hid[dev.num_hid].iface = iface;
+			dev.hid[dev.num_hid].boot = (subclass == 1) ? protocol : 0;
+			memcpy(dev.hid[dev.num_hid].desc, c + pos, 9);
+			dev.num_hid++;
+			break;
+
+			case  5:
+			if (c[pos] < 7 || !endpoints || dev.num_ep == SIM_MAX_ENDPOINTS) {
+				enum_fail("configuration descriptor: endpoint descriptor at offset %u beyond bNumEndpoints", pos);
+				return;
+			}
+			endpoints--;
+			dev.ep[dev.num_ep++] = c + pos;
+			break;
+		}
+	}
+	if (endpoints) {
+		enum_fail("configuration descriptor: interface %u is missing %u endpoint descriptors", iface, endpoints);
+	} else if (interfaces != c[4]) {
+		enum_fail("configuration descriptor: bNumInterfaces is %u, %u interfaces described", c[4], interfaces);
+	}
+}
+
+// parse a report descriptor item by item
+static void  report_walk(const uint8_t *d, uint16_t len, uint8_t iface)
+{
+	uint16_t	pos = 0;
+	uint8_t		size;
+	int			depth = 0;
+
+	while (pos < len) {
+		if (d[pos] == 0xfe) {					// long item
+			size = (pos + 1 < len) ? d[pos + 1] + 2 : 2;
+		} else {
+			size = (d[pos] & 3) == 3 ? 4 : (d[pos] & 3);
+			if ((d[pos] & 0xfc) == 0xa0) depth++;
+			if ((d[pos] & 0xfc) == 0xc0 && --depth < 0) {
+				enum_fail("report descriptor of interface %u: End Collection at offset %u ends nothing", iface, pos);
+				return;
+			}
+		}
+		pos += 1 + size;
+	}
+	if (pos != len) {
+		enum_fail("report descriptor of interface %u: the last item runs past its %u bytes", iface, len);
+	} else if (depth) {
+		enum_fail("report descriptor of interface %u: %d collections left open", iface, depth);
+	}
+}
+
+// check the answer to the enumeration request just completed
+static void  enum_check(void)
+{
+	const uint8_t	*d = host.data;
+	const uint8_t	*e;
+	uint16_t		len = host.len;
+	uint16_t		size;
+	uint8_t			n, num;
+
+	switch (host.step) {
+		case  ENUM_DEVICE_FIRST:
+		case  ENUM_DEVICE:
+		if (len != 18 || d[0] != 18 || d[1] != 1) {
+			enum_fail("device descriptor: %u bytes, bLength %u, bDescriptorType %u", len, d[0], d[1]);
+		} else if (d[7] != ep_size(&ep[0])) {
+			enum_fail("device descriptor: bMaxPacketSize0 is %u, endpoint 0 is set up for %u", d[7], ep_size(&ep[0]));
+		} else if (!d[17]) {
+			enum_fail("device descriptor: no configurations");
+		}
+		memcpy(dev.device, d, 18);
+		break;
+
+		case  ENUM_CONFIG_HEAD:
+		dev.total = d[2] | (d[3] << 8);
+		if (len != 9 || d[0] != 9 || d[1] != 2) {
+			enum_fail("configuration descriptor: %u bytes, bLength %u, bDescriptorType %u", len, d[0], d[1]);
+		} else if (dev.total < 9 || dev.total > sizeof(dev.config)) {
+			enum_fail("configuration descriptor: wTotalLength %u", dev.total);
+		}
+		break;
+
+		case  ENUM_CONFIG:
+		if (len != dev.total) {
+			enum_fail("configuration descriptor: %u bytes, wTotalLength %u", len, dev.total);
+			break;
+		}
+		memcpy(dev.config, d, len);
+		config_walk();
+		break;
+
+		case  ENUM_LANGIDS:
+		case  ENUM_STRING:
+		if (len < 2 || d[0] != len || d[1] != 3 || (len & 1) || (host.step == ENUM_LANGIDS && len < 4)) {
+			enum_fail("string descriptor %u: %u bytes, bLength %u, bDescriptorType %u",
+					  host.setup[2], len, d[0], d[1]);
+		}
+		if (host.step == ENUM_LANGIDS) dev.langid = d[2] | (d[3] << 8);
+		break;
+
+		case  ENUM_SET_CONFIG:
+		sim_sync();
+		for (n=0; n<dev.num_ep; n++) {
+			e = dev.ep[n];
+			num = e[2] & 0x0f;
+			size = e[4] | (e[5] << 8);
+			if (!num || num >= SIM_NUM_EP || !ep[num].alloc) {
+				enum_fail("endpoint %02x is described but not set up", e[2]);
+			} else if (ep_is_in(num) != !!(e[2] & 0x80) || (ep[num].reg[SIM_UECFG0X] >> 6) != (e[3] & 3)
+					   || size > ep_size(&ep[num])) {
+				enum_fail("endpoint %02x is set up for %u bytes, type %u, unlike its descriptor",
+						  e[2], ep_size(&ep[num]), ep[num].reg[SIM_UECFG0X] >> 6);
+			}
+		}
+		break;
+
+		case  ENUM_HID_DESC:
+		if (len != 9 || memcmp(d, dev.hid[host.sub].desc, 9)) {
+			enum_fail("HID descriptor of interface %u differs from its copy in the configuration descriptor",
+					  dev.hid[host.sub].iface);
+		}
+		break;
+
+		case  ENUM_REPORT_DESC:
+		if (len != (host.setup[6] | (host.setup[7] << 8))) {
+			enum_fail("report descriptor of interface %u: %u bytes, the HID descriptor says %u",
+					  dev.hid[host.sub].iface, len, host.setup[6] | (host.setup[7] << 8));
+			break;
+		}
+		report_walk(d, len, dev.hid[host.sub].iface);
+		break;
+	}
+}
+
+// suspend and resume
+static void  bus_service(void)
+{
+	switch (host.bus) {
+		case  BUS_SUSPENDING:
+		if (sim_cycles < host.bus_at) break;
+		udint |= (1<<SUSPI);
+		host.bus = BUS_SUSPENDED;
+		break;
+
+		case  BUS_SUSPENDED:
+		if ((UDCON & (1<<RMWKUP)) && !(USBCON & (1<<FRZCLK))) {
+			UDCON &= ~(1<<RMWKUP);			// upstream resume sent
+			udint |= (1<<UPRSMI);
+			sim_remote_wakeups++;
+			host.bus = BUS_RESUMING;
+			host.bus_at = sim_cycles + SIM_CYCLES_PER_MS + SIM_RESUME_CYCLES;
+		}
+		break;
+
+		case  BUS_RESUMING:
+		if (sim_cycles < host.bus_at) break;
+		udint |= (1<<EORSMI);
+		host.bus = BUS_ACTIVE;
+		sim_suspended_cycles += sim_cycles - host.suspended_at;
+		next_frame = sim_cycles + SIM_CYCLES_PER_FRAME;
+		break;
+	}
+}
+
+static void  host_service(void)
+{
+	static uint8_t		busy;
+	uint8_t				e;
+
+	if (busy) return;
+	busy = 1;
+	bus_service();
+	if (host.bus != BUS_ACTIVE) {			// no transfers on a suspended bus
+		busy = 0;
+		return;
+	}
+	switch (host.state) {
+		case  HOST_DETACHED:
+		if ((USBCON & (1<<USBE)) && !(USBCON & (1<<FRZCLK)) && !(UDCON & (1<<DETACH))) {
+			host.state = HOST_RESET;
+			host.reset_at = sim_cycles + SIM_ATTACH_CYCLES + SIM_RESET_CYCLES;
+		}
+		break;
+
+		case  HOST_RESET:
+		if (sim_cycles < host.reset_at) break;
+		for (e=0; e<SIM_NUM_EP; e++) {			// the reset disables every endpoint
+			memset((void *)ep[e].reg, 0, sizeof(ep[e].reg));
+			memset(&ep[e].shadow, 0, sizeof(ep[e]) - offsetof(struct sim_ep, shadow));
+		}
+		UDADDR = 0;
+		udint |= (1<<EORSTI);
+		host.state = HOST_ENUMERATING;
+		host.step = ENUM_DEVICE_FIRST;
+		host.sub = 0;
+		host.phase = XFER_IDLE;
+		host.enum_started = sim_cycles;
+		host.enum_transfers = 0;
+		enum_skip();
+		break;
+
+		case  HOST_ENUMERATING:
+		if (host.phase == XFER_IDLE) {
+			sim_sync();
+			if (!ep[0].alloc) break;			// wait for the reset to be handled
+			memset(host.data, 0, sizeof(host.data));	// SET_REPORT: every LED off
+			xfer_start(host.enum_setup);
+			break;
+		}
+		if (!xfer_service()) break;
+		sim_control_transfers++;
+		host.enum_transfers++;
+		if (host.state != HOST_FAILED) enum_check();
+		if (host.state == HOST_FAILED) {
+			fprintf(stderr, "sim: enumeration failed\n");
+			exit(2);
+		}
+		enum_next();
+		enum_skip();
+		break;
+
+		case  HOST_CONFIGURED:
+		if (host.phase == XFER_IDLE) {
+			// The endpoint 0 handler may still be finishing the last
+			// request; a new SETUP must not land under its feet.
+			if (!control_count || in_isr) break;
+			xfer_start(control_queue[control_head].setup);
+			memcpy(host.data, control_queue[control_head].data, sizeof(control_queue[0].data));
+			break;
+		}
+		if (!xfer_service()) break;
+		sim_control_transfers++;
+		if (sim_on_control) {
+			sim_on_control(host.setup, host.state == HOST_FAILED ? -1 : host.len, host.data);
+		}
+		host.state = HOST_CONFIGURED;			// a stalled request is not fatal here
+		control_head = (control_head + 1) % SIM_CONTROL_QUEUE;
+		control_count--;
+		break;
+	}
+	busy = 0;
+}
+
+int  sim_host_control(const uint8_t *setup, const uint8_t *data)
+{
+	uint8_t		n;
+	uint16_t	wLength = setup[6] | (setup[7] << 8);
+
+	if (control_count == SIM_CONTROL_QUEUE) return -1;
+	if (!(setup[0] & 0x80) && wLength > sizeof(control_queue[0].data)) return -1;
+	n = (control_head + control_count) % SIM_CONTROL_QUEUE;
+	memcpy(control_queue[n].setup, setup, 8);
+	memset(control_queue[n].data, 0, sizeof(control_queue[n].data));
+	if (data && !(setup[0] & 0x80)) memcpy(control_queue[n].data, data, wLength);
+	control_count++;
+	return 0;
+}
+
+void  sim_host_reset(void)
+{
+	if (host.state == HOST_DETACHED || host.state == HOST_RESET) return;
+	host.state = HOST_RESET;
+	host.reset_at = sim_cycles + SIM_RESET_CYCLES;
+	host.phase = XFER_IDLE;
+	next_poll = 0;
+}
+
+void  sim_host_suspend(void)
+{
+	if (host.bus != BUS_ACTIVE) return;
+	host.bus = BUS_SUSPENDING;
+	host.bus_at = sim_cycles + SIM_SUSPEND_IDLE;
+	host.suspended_at = sim_cycles;
+	next_poll = 0;
+}
+
+void  sim_host_resume(void)
+{
+	if (host.bus != BUS_SUSPENDED && host.bus != BUS_SUSPENDING) return;
+	udint |= (1<<WAKEUPI);					// bus activity, seen even with the clock frozen
+	host.bus = BUS_RESUMING;
+	host.bus_at = sim_cycles + SIM_RESUME_CYCLES;
+}
+
+void  sim_host_pause(uint64_t cycles)
+{
+	poll_paused_until = sim_cycles + cycles;
+}
+
+uint8_t  sim_host_configured(void)
+{
+	return host.state == HOST_CONFIGURED;
+}
@@ -0,0 +1,119 @@
+/*
+ *  host/sim.h
+ *
+ *  Simulator interface for the host-native build (make host).
+ *
+ *  The simulator stands in for the Teensy++ 2.0 hardware: it owns the
+ *  I/O register shim declared in host/avr/io.h, a 9x8 keyboard matrix
+ *  wired to the strobe and sense ports the same way the VIC-20 connector
+ *  is, the at90usb1286 USB device controller, and a USB host that
+ *  enumerates the firmware as Linux does, checking every descriptor it
+ *  reads, and polls its interrupt endpoint once per frame.
+ *
+ *  Simulated time only moves when the firmware touches a shimmed register,
+ *  calls one of the _delay_*() macros, or sleeps.  Interrupts are
+ *  dispatched at those points when the I bit in SREG is set, so the
+ *  firmware runs single-threaded and deterministically.
+ */
+
+#ifndef sim_h__
+#define sim_h__
+
+#include <stdint.h>
+
+#define SIM_CYCLES_PER_US		(F_CPU / 1000000UL)
+#define SIM_CYCLES_PER_MS		(F_CPU / 1000UL)
+#define SIM_CYCLES_PER_FRAME	SIM_CYCLES_PER_MS
+
+#define SIM_NUM_LINES			9		/* strobe lines: PF0-PF7, PE0 */
+#define SIM_NUM_SENSE			8		/* sense lines: PC0-PC7 */
+
+/*
+ *  Simulated time, in CPU cycles since power-on.
+ */
+extern uint64_t			sim_cycles;
+extern uint64_t			sim_sleep_cycles;		// of which the CPU spent asleep
+extern uint64_t			sim_power_down_cycles;	// of which in power-down
+extern uint64_t			sim_suspended_cycles;	// the host kept the bus suspended
+extern unsigned			sim_remote_wakeups;
+
+/*
+ *  Longest and total time each interrupt handler has run for, in
+ *  simulated cycles.  Time only passes in the simulation on register
+ *  accesses, one cycle each, and on waits, so for a handler that never
+ *  waits this is its count of register accesses.  It is not an execution
+ *  time: instructions that touch no register cost nothing here.
+ */
+enum {
+	SIM_VECTOR_USB_GEN,
+	SIM_VECTOR_USB_COM,
+	SIM_VECTOR_TIMER1_COMPA,
+	SIM_VECTOR_WDT,
+	SIM_NUM_VECTORS
+};
+
+extern uint64_t			sim_isr_max_cycles[SIM_NUM_VECTORS];
+extern uint64_t			sim_isr_total_cycles[SIM_NUM_VECTORS];
+extern unsigned			sim_isr_count[SIM_NUM_VECTORS];
+
+/*
+ *  The last enumeration: the time from the end of the bus reset to the
+ *  answer to its last request, and the number of control transfers it
+ *  took.  sim_control_transfers counts every control transfer completed,
+ *  enumeration included.
+ */
+extern uint64_t			sim_enum_cycles;
+extern unsigned			sim_enum_transfers;
+extern unsigned			sim_control_transfers;
+
+/*
+ *  Keyboard matrix.  Bit n of sim_matrix[r] is set while the switch
+ *  between strobe line r and sense line n is closed.  There are no
+ *  diodes: a line driven low pulls down every sense line it reaches
+ *  through closed switches, also by way of other strobe lines, so three
+ *  corners of a rectangle closed make the fourth read closed too.
+ */
+extern uint8_t			sim_matrix[SIM_NUM_LINES];
+extern unsigned long	sim_scans;				// reads of the sense port with line 0 alone driven
+
+/*
+ *  Time the sense port takes to follow a change of the matrix lines.
+ */
+extern uint64_t			sim_settle_cycles;
+
+/*
+ *  EEPROM contents; erased (all 0xff) at power-on unless the driver
+ *  loads an image.
+ */
+#define SIM_EEPROM_SIZE			4096
+#define SIM_EEPROM_WRITE_CYCLES	(3400 * SIM_CYCLES_PER_US)
+
+extern uint8_t			sim_eeprom[SIM_EEPROM_SIZE];
+extern unsigned			sim_eeprom_writes;		// bytes written since power-on
+
+/*
+ *  Hooks for the driver (host/sim_main.c).
+ *
+ *  sim_on_time is called every time simulated time advances.
+ *  sim_on_report is called when the host reads a packet from an
+ *  interrupt IN endpoint.
+ *  sim_on_control is called when a request queued with sim_host_control()
+ *  completes; len is the number of data bytes transferred, or -1 if the
+ *  firmware stalled the request.
+ *  sim_wakeup bounds how far a single delay step may run, so that
+ *  scripted events are applied at their exact time.
+ */
+extern void				(*sim_on_time)(void);
+extern void				(*sim_on_report)(uint8_t ep, const uint8_t *data, uint8_t len);
+extern void				(*sim_on_control)(const uint8_t *setup, int len, const uint8_t *data);
+extern uint64_t			sim_wakeup;
+
+void		sim_advance(uint64_t cycles);
+uint8_t		sim_host_configured(void);
+int			sim_host_control(const uint8_t *setup, const uint8_t *data);
+void		sim_host_pause(uint64_t cycles);	// stop reading interrupt endpoints for a while
+void		sim_host_reset(void);				// reset the bus and enumerate again
+void		sim_host_suspend(void);				// stop the frames, suspending the bus
+void		sim_host_resume(void);				// resume a suspended bus
+
+#endif
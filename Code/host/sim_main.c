@@ -0,0 +1,678 @@
+/*
+ *  host/sim_main.c
+ *
+ *  Trace runner for the host-native build.
+ *
+ *  Usage:  Vic20_usb_keyboard_host [-q | -g] [-e eeprom-image] trace-file
+ *          Vic20_usb_keyboard_host -i [-e eeprom-image]
+ *
+ *  Boots the unmodified firmware against the simulator (host/sim.c),
+ *  drives the keyboard matrix from a scripted trace, captures every
+ *  report the simulated host reads from the keyboard endpoint, checks
+ *  the sequence of reports against the trace's expectations and times
+ *  each one from the key event that caused it.  The run ends with how
+ *  long the simulated host took to enumerate the keyboard and how many
+ *  register accesses the endpoint 0 interrupt made per control transfer
+ *  (see sim.h: a count of accesses, not an execution time), and the
+ *  throughput of the replay: matrix scans and key events per second of
+ *  wall time.
+ *
+ *  With -g the expectations in the trace are not checked; instead the
+ *  reports captured are printed as expect-keys lines, followed by an
+ *  end line, ready to be appended to a trace recorded from a real
+ *  keyboard with tools/vic20cfg record, which makes it a regression
+ *  trace for host/traces.  Check the printed reports are right first.
+ *
+ *  With -e the EEPROM starts out with the contents of the image file, if
+ *  it exists, and is written back to it when the run ends.
+ *
+ *  With -i there is no trace; directives are read from standard input
+ *  one at a time, without a time, and each is answered on standard
+ *  output once it has completed, which is how tools/vic20cfg talks to the
+ *  simulated keyboard:
+ *
+ *	control <bmRequestType> ...	as in a trace; answered "ok" and, for
+ *								an IN request, the bytes read, or "stall"
+ *	wait <ms>					let simulated time run; answered "ok"
+ *	down|up <row> <col>			as in a trace; answered "ok"
+ *
+ *  The run ends at end of input.
+ *
+ *  Trace format, one directive per line, '#' starts a comment:
+ *
+ *	<ms> down <row> <col>		close the switch at matrix row/col
+ *	<ms> up <row> <col>			open it again
+ *	<ms> control <bmRequestType> <bRequest> <wValue> <wIndex> <wLength> [<data> ...]
+ *								issue a control request on endpoint 0
+ *	<ms> pause <ms>				the host stops reading the keyboard endpoint
+ *								for this long
+ *	<ms> reset					the host resets the bus and enumerates the
+ *								keyboard again, as after a KVM switch
+ *	<ms> suspend				the host stops sending frames, suspending
+ *								the bus
+ *	<ms> resume					the host resumes a suspended bus
+ *	expect <hex> <hex> ...		next distinct report must match exactly
+ *	expect-keys <mod> [<usage> ...]
+ *								next distinct report must carry exactly
+ *								this modifier byte and set of usages, in
+ *								either the boot or the N-key rollover format
+ *	expect-control <hex> ...	next control read must return exactly these
+ *								bytes; "--" matches any byte
+ *	expect-control stall		next control read must be stalled
+ *	max-latency <ms>			every report must reach the host within this
+ *								long of its event
+ *	max-isr <accesses>			no interrupt handler may make more register
+ *								accesses, counting any wait as one per cycle
+ *								(see sim.h; not an execution time)
+ *	settle <us>					time the sense lines take to follow a change
+ *								of the matrix lines (default 2 us)
+ *	end <ms>					stop the run at this time
+ *
+ *  The fields of a control request and all expected values are hex.
+ *  Times are milliseconds since power-on and must be in order.  Rows are
+ *  strobe lines (0-8, as in keyMapping), columns are sense lines (0-7).
+ *  Reports identical to the previous one (idle re-sends) are not
+ *  compared.  A report's latency is measured from the event that last
+ *  moved the matrix away from its state at the previous report, so the
+ *  bounce before a switch settles is not counted.
+ *  The exit status is 0 when every expectation matched.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sim.h"
+
+
+#define MAX_EXPECT		1024			/* control reads; reports and events grow as needed */
+#define MAX_REPORT		64
+
+int		firmware_main(void);			// the firmware's main(), renamed by the Makefile
+
+#define EVENT_UP		0
+#define EVENT_DOWN		1
+#define EVENT_CONTROL	2
+#define EVENT_PAUSE		3
+#define EVENT_SUSPEND	4
+#define EVENT_RESUME	5
+#define EVENT_RESET		6
+
+struct event {
+	uint64_t	at;						// cycles
+	uint8_t		type;
+	uint8_t		row, col;
+	uint8_t		setup[8];				// control requests only
+	uint8_t		data[64];
+	uint64_t	duration;				// pauses only
+};
+
+struct expect {
+	uint8_t		data[MAX_REPORT];
+	uint8_t		len;
+	uint8_t		keys;					// compare as modifier byte + usage set
+};
+
+static struct event		*events;
+static unsigned			num_events, max_events, next_event;
+
+static struct expect	*expect;
+static unsigned			num_expect, max_expect, next_expect, matched, mismatches;
+
+static uint8_t			ctl_expect[MAX_EXPECT][MAX_REPORT];
+static uint8_t			ctl_care[MAX_EXPECT][MAX_REPORT];	// 0 for a "--" byte
+static int				ctl_len[MAX_EXPECT];				// -1 for a stall
+static unsigned			num_ctl, next_ctl, ctl_matched;
+
+static uint64_t			end_at;
+static uint8_t			last_report[MAX_REPORT];
+static uint8_t			last_len;
+static unsigned			num_reports, num_repeats;
+
+static uint64_t			pending_since;	// last event moving the matrix from its reported state
+static uint8_t			pending;
+static uint8_t			reported_matrix[SIM_NUM_LINES];	// matrix when the last report arrived
+static uint64_t			lat_min = UINT64_MAX, lat_max, lat_sum;
+static unsigned			lat_count;
+static uint64_t			lat_limit = UINT64_MAX;
+static uint64_t			isr_limit = UINT64_MAX;
+
+static const char		*trace_name;
+static const char		*eeprom_name;
+static int				quiet;
+static int				interactive;
+static int				generate;		// print expectations instead of checking them
+static unsigned long	num_edges;		// matrix events applied
+static uint8_t			outstanding;	// interactive control request not yet answered
+static uint64_t			wait_until;		// interactive wait, 0 if none
+static struct timespec	wall_start;
+
+
+static double  ms(uint64_t cycles)
+{
+	return (double)cycles / SIM_CYCLES_PER_MS;
+}
+
+// make room for one more of the used elements of a growing array
+static void  *grow(void *array, unsigned *size, unsigned used, size_t elem)
+{
+	if (used < *size) return array;
+	*size = *size ? *size * 2 : 256;
+	array = realloc(array, *size * elem);
+	if (!array) {
+		perror("trace");
+		exit(2);
+	}
+	return array;
+}
+
+// parse hex bytes from p into buf; returns the number of bytes stored
+static unsigned  parse_hex(const char *p, uint8_t *buf, unsigned max)
+{
+	char		*q;
+	long		v;
+	unsigned	n = 0;
+
+	while ((v = strtol(p, &q, 16)), q != p) {
+		if (n < max) buf[n++] = v;
+		p = q;
+	}
+	return n;
+}
+
+/*
+ *  Reduce a keyboard report to its modifier byte and the set of usages it
+ *  holds.  An 8 byte report is the boot format (modifiers, reserved, six
+ *  usages); anything longer is modifiers followed by a usage bitmap.
+ */
+static void  decode_keys(const uint8_t *data, uint8_t len, uint8_t *mod, uint8_t keys[32])
+{
+	uint8_t		i;
+
+	memset(keys, 0, 32);
+	*mod = len ? data[0] : 0;
+	if (len == 8) {
+		for (i=2; i<8; i++) {
+			if (data[i]) keys[data[i] >> 3] |= 1 << (data[i] & 7);
+		}
+	} else {
+		for (i=1; i<len && i<=32; i++) keys[i-1] = data[i];
+	}
+}
+
+static uint8_t  match_keys(const uint8_t *exp, uint8_t exp_len, const uint8_t *data, uint8_t len)
+{
+	uint8_t		mod, keys[32], want[32], i;
+
+	decode_keys(data, len, &mod, keys);
+	memset(want, 0, sizeof(want));
+	for (i=1; i<exp_len; i++) {
+		if (exp[i]) want[exp[i] >> 3] |= 1 << (exp[i] & 7);
+	}
+	return exp_len && mod == exp[0] && !memcmp(keys, want, sizeof(keys));
+}
+
+// print a report as the expect-keys line that matches it
+static void  print_keys(const uint8_t *data, uint8_t len)
+{
+	uint8_t		mod, keys[32];
+	unsigned	k;
+
+	decode_keys(data, len, &mod, keys);
+	printf("expect-keys\t%02x", mod);
+	for (k=0; k<256; k++) {
+		if (keys[k >> 3] & (1 << (k & 7))) printf(" %02x", k);
+	}
+	printf("\n");
+}
+
+// parse the fields of a control directive at p into e; returns 0 if they are valid
+static int  parse_control(const char *p, struct event *e)
+{
+	char			*q;
+	unsigned long	field;
+	unsigned		n;
+
+	for (n=0; n<5; n++) {						// bmRequestType, bRequest, wValue, wIndex, wLength
+		field = strtoul(p, &q, 16);
+		if (q == p) return -1;
+		p = q;
+		if (n < 2) {
+			e->setup[n] = field;
+		} else {
+			e->setup[n*2-2] = field;
+			e->setup[n*2-1] = field >> 8;
+		}
+	}
+	parse_hex(p, e->data, sizeof(e->data));
+	return 0;
+}
+
+static void  load_eeprom(void)
+{
+	FILE		*f;
+
+	if (!eeprom_name || !(f = fopen(eeprom_name, "rb"))) return;
+	if (fread(sim_eeprom, 1, SIM_EEPROM_SIZE, f) == 0) {
+		memset(sim_eeprom, 0xff, SIM_EEPROM_SIZE);
+	}
+	fclose(f);
+}
+
+static void  save_eeprom(void)
+{
+	FILE		*f;
+
+	if (!eeprom_name) return;
+	f = fopen(eeprom_name, "wb");
+	if (!f || fwrite(sim_eeprom, 1, SIM_EEPROM_SIZE, f) != SIM_EEPROM_SIZE) {
+		perror(eeprom_name);
+		exit(2);
+	}
+	fclose(f);
+}
+
+static void  load_trace(const char *path)
+{
+	FILE		*f;
+	char		line[512], word[16], *p, *q;
+	double		t, d, last = 0;
+	unsigned	row, col, lineno = 0, n;
+	long		v;
+	int			pos;
+	struct event	*e;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(2);
+	}
+	end_at = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		pos = 0;
+		if ((p = strchr(line, '#'))) *p = 0;
+		if (sscanf(line, " %15s", word) != 1) continue;
+		if (!strcmp(word, "expect-control")) {
+			if (num_ctl == MAX_EXPECT) goto full;
+			p = strstr(line, word) + strlen(word);
+			if (sscanf(p, " %15s", word) == 1 && !strcmp(word, "stall")) {
+				ctl_len[num_ctl++] = -1;
+				continue;
+			}
+			for (n=0; n<MAX_REPORT; n++) {
+				while (*p == ' ' || *p == '\t') p++;
+				if (!strncmp(p, "--", 2)) {
+					ctl_care[num_ctl][n] = 0;
+					p += 2;
+				} else {
+					v = strtol(p, &q, 16);
+					if (q == p) break;
+					ctl_expect[num_ctl][n] = v;
+					ctl_care[num_ctl][n] = 1;
+					p = q;
+				}
+			}
+			ctl_len[num_ctl++] = n;
+		} else if (!strcmp(word, "expect") || !strcmp(word, "expect-keys")) {
+			expect = grow(expect, &max_expect, num_expect, sizeof(*expect));
+			p = strstr(line, word) + strlen(word);
+			expect[num_expect].keys = (word[6] == '-');
+			expect[num_expect].len = parse_hex(p, expect[num_expect].data, MAX_REPORT);
+			if (expect[num_expect].keys && !expect[num_expect].len) goto bad;
+			num_expect++;
+		} else if (sscanf(line, " %lf control %n", &t, &pos) == 1 && pos) {
+			events = grow(events, &max_events, num_events, sizeof(*events));
+			if (t < last) goto bad;
+			last = t;
+			e = &events[num_events++];
+			memset(e, 0, sizeof(*e));
+			e->at = t * SIM_CYCLES_PER_MS;
+			e->type = EVENT_CONTROL;
+			if (parse_control(line + pos, e)) goto bad;
+		} else if (sscanf(line, " %lf pause %lf", &t, &d) == 2) {
+			events = grow(events, &max_events, num_events, sizeof(*events));
+			if (t < last) goto bad;
+			last = t;
+			e = &events[num_events++];
+			memset(e, 0, sizeof(*e));
+			e->at = t * SIM_CYCLES_PER_MS;
+			e->type = EVENT_PAUSE;
+			e->duration = d * SIM_CYCLES_PER_MS;
+		} else if (sscanf(line, " %lf %15s", &t, word) == 2
+				   && (!strcmp(word, "suspend") || !strcmp(word, "resume") || !strcmp(word, "reset"))) {
+			events = grow(events, &max_events, num_events, sizeof(*events));
+			if (t < last) goto bad;
+			last = t;
+			e = &events[num_events++];
+			memset(e, 0, sizeof(*e));
+			e->at = t * SIM_CYCLES_PER_MS;
+			e->type = !strcmp(word, "suspend") ? EVENT_SUSPEND
+					: !strcmp(word, "resume") ? EVENT_RESUME : EVENT_RESET;
+		} else if (sscanf(line, " max-latency %lf", &d) == 1) {
+			lat_limit = d * SIM_CYCLES_PER_MS;
+		} else if (sscanf(line, " max-isr %lf", &d) == 1) {
+			isr_limit = d;
+		} else if (sscanf(line, " settle %lf", &d) == 1) {
+			sim_settle_cycles = d * SIM_CYCLES_PER_US;
+		} else if (sscanf(line, " end %lf", &t) == 1) {
+			end_at = t * SIM_CYCLES_PER_MS;
+		} else if (sscanf(line, " %lf %15s %u %u", &t, word, &row, &col) == 4
+				   && (!strcmp(word, "down") || !strcmp(word, "up"))) {
+			events = grow(events, &max_events, num_events, sizeof(*events));
+			if (t < last || row >= SIM_NUM_LINES || col >= SIM_NUM_SENSE) goto bad;
+			last = t;
+			e = &events[num_events++];
+			e->at = t * SIM_CYCLES_PER_MS;
+			e->type = strcmp(word, "down") ? EVENT_UP : EVENT_DOWN;
+			e->row = row;
+			e->col = col;
+		} else {
+			goto bad;
+		}
+	}
+	fclose(f);
+	if (!end_at) end_at = (uint64_t)(last + 1000) * SIM_CYCLES_PER_MS;
+	return;
+
+bad:
+	fprintf(stderr, "%s:%u: bad trace line\n", path, lineno);
+	exit(2);
+full:
+	fprintf(stderr, "%s:%u: trace too long\n", path, lineno);
+	exit(2);
+}
+
+static void  finish(void)
+{
+	struct timespec		now;
+	double				wall, sim;
+	int					ok;
+	uint64_t			isr_max = 0;
+	unsigned			v;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wall = (now.tv_sec - wall_start.tv_sec) + (now.tv_nsec - wall_start.tv_nsec) / 1e9;
+	sim = ms(sim_cycles) / 1000.0;
+	for (v=0; v<SIM_NUM_VECTORS; v++) {
+		if (sim_isr_max_cycles[v] > isr_max) isr_max = sim_isr_max_cycles[v];
+	}
+	if (generate) {
+		printf("end\t\t%.0f\n", ms(end_at));
+		exit(0);
+	}
+	ok = (mismatches == 0) && (next_expect == num_expect) && (next_ctl == num_ctl)
+		&& (!lat_count || lat_max <= lat_limit) && isr_max <= isr_limit;
+	save_eeprom();
+
+	printf("%s: %u reports (%u repeats), %u/%u expected reports matched\n",
+		   trace_name, num_reports, num_repeats, matched, num_expect);
+	if (num_ctl) {
+		printf("%u/%u expected control reads matched\n", ctl_matched, num_ctl);
+	}
+	if (lat_count) {
+		printf("latency (event to host poll): min %.3f ms  avg %.3f ms  max %.3f ms\n",
+			   ms(lat_min), ms(lat_sum) / lat_count, ms(lat_max));
+		if (lat_max > lat_limit) printf("latency over the %.3f ms limit\n", ms(lat_limit));
+	}
+	printf("enumeration: %u control transfers in %.3f ms from bus reset; "
+		   "%u control transfers, usb_com %.0f register accesses per transfer\n",
+		   sim_enum_transfers, ms(sim_enum_cycles), sim_control_transfers,
+		   sim_control_transfers ? (double)sim_isr_total_cycles[SIM_VECTOR_USB_COM]
+			   / sim_control_transfers : 0);
+	printf("longest interrupt, in register accesses: usb_gen %llu  usb_com %llu  timer1 %llu\n",
+		   (unsigned long long)sim_isr_max_cycles[SIM_VECTOR_USB_GEN],
+		   (unsigned long long)sim_isr_max_cycles[SIM_VECTOR_USB_COM],
+		   (unsigned long long)sim_isr_max_cycles[SIM_VECTOR_TIMER1_COMPA]);
+	if (isr_max > isr_limit) {
+		printf("interrupt over the limit of %llu register accesses\n", (unsigned long long)isr_limit);
+	}
+	printf("simulated %.3f s in %.3f s wall (%.0fx real time), cpu asleep %.1f%%\n",
+		   sim, wall, wall > 0 ? sim / wall : 0, 100.0 * sim_sleep_cycles / sim_cycles);
+	printf("replayed %lu scans and %lu key events: %.0f scans/s, %.0f events/s wall\n",
+		   sim_scans, num_edges, wall > 0 ? sim_scans / wall : 0, wall > 0 ? num_edges / wall : 0);
+	if (sim_suspended_cycles) {
+		printf("suspended %.3f s, cpu powered down %.1f%% of it, %u remote wakeups\n",
+			   ms(sim_suspended_cycles) / 1000.0,
+			   100.0 * sim_power_down_cycles / sim_suspended_cycles, sim_remote_wakeups);
+	}
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	exit(ok ? 0 : 1);
+}
+
+static void  reply(const char *s)
+{
+	printf("%s\n", s);
+	fflush(stdout);
+}
+
+// take the next interactive directive, once the last one has completed
+static void  interact(void)
+{
+	char			line[512], word[16];
+	unsigned		row, col;
+	double			d;
+	int				pos;
+	struct event	e;
+
+	if (!sim_host_configured() || outstanding) return;
+	if (wait_until) {
+		if (sim_cycles < wait_until) return;
+		wait_until = 0;
+		reply("ok");
+	}
+	while (1) {
+		if (!fgets(line, sizeof(line), stdin)) {
+			save_eeprom();
+			exit(0);
+		}
+		pos = 0;
+		if (sscanf(line, " %15s", word) != 1) continue;
+		if (sscanf(line, " control %n", &pos) == 0 && pos) {
+			memset(&e, 0, sizeof(e));
+			if (parse_control(line + pos, &e) == 0 && sim_host_control(e.setup, e.data) == 0) {
+				outstanding = 1;
+				return;
+			}
+		} else if (sscanf(line, " wait %lf", &d) == 1 && d >= 0) {
+			wait_until = sim_cycles + (uint64_t)(d * SIM_CYCLES_PER_MS) + 1;
+			sim_wakeup = wait_until;
+			return;
+		} else if (sscanf(line, " %15s %u %u", word, &row, &col) == 3
+				   && (!strcmp(word, "down") || !strcmp(word, "up"))
+				   && row < SIM_NUM_LINES && col < SIM_NUM_SENSE) {
+			if (!strcmp(word, "down")) sim_matrix[row] |= (1 << col);
+			else sim_matrix[row] &= ~(1 << col);
+			reply("ok");
+			continue;
+		}
+		reply("error");
+	}
+}
+
+static void  on_time(void)
+{
+	struct event	*e;
+
+	if (interactive) {
+		interact();
+		return;
+	}
+
+	while (next_event < num_events && events[next_event].at <= sim_cycles) {
+		e = &events[next_event++];
+		if (e->type == EVENT_CONTROL) {
+			if (sim_host_control(e->setup, e->data) < 0) {
+				fprintf(stderr, "%10.3f ms  control request queue full\n", ms(sim_cycles));
+				mismatches++;
+			}
+			continue;
+		}
+		if (e->type == EVENT_PAUSE) {
+			sim_host_pause(e->duration);
+			continue;
+		}
+		if (e->type == EVENT_SUSPEND) {
+			sim_host_suspend();
+			continue;
+		}
+		if (e->type == EVENT_RESUME) {
+			sim_host_resume();
+			continue;
+		}
+		if (e->type == EVENT_RESET) {
+			sim_host_reset();
+			continue;
+		}
+		if (e->type == EVENT_DOWN) sim_matrix[e->row] |= (1 << e->col);
+		else sim_matrix[e->row] &= ~(1 << e->col);
+		num_edges++;
+		if (!memcmp(sim_matrix, reported_matrix, sizeof(sim_matrix))) {
+			pending = 0;						// bounced back, nothing new to report
+		} else {
+			pending = 1;						// time the report from the latest edge
+			pending_since = e->at;
+		}
+	}
+	sim_wakeup = (next_event < num_events) ? events[next_event].at : end_at;
+	if (sim_cycles >= end_at) finish();
+}
+
+static void  on_report(uint8_t ep, const uint8_t *data, uint8_t len)
+{
+	uint64_t		lat;
+	uint8_t			i, match;
+	struct expect	*e;
+
+	if (len > MAX_REPORT) len = MAX_REPORT;
+	if (!last_len) last_len = len;				// the host starts out with an empty report
+	if (len == last_len && !memcmp(data, last_report, len)) {
+		num_repeats++;
+		return;
+	}
+	memcpy(last_report, data, len);
+	last_len = len;
+	memcpy(reported_matrix, sim_matrix, sizeof(sim_matrix));
+	num_reports++;
+
+	if (!quiet && !generate) {
+		printf("%10.3f ms  ep%u ", ms(sim_cycles), ep);
+		for (i=0; i<len; i++) printf(" %02x", data[i]);
+	}
+	if (pending) {
+		pending = 0;
+		lat = sim_cycles - pending_since;
+		if (lat < lat_min) lat_min = lat;
+		if (lat > lat_max) lat_max = lat;
+		lat_sum += lat;
+		lat_count++;
+		if (!quiet && !generate) printf("  (+%.3f ms)", ms(lat));
+	}
+
+	if (generate) {
+		print_keys(data, len);
+	} else if (next_expect < num_expect) {
+		e = &expect[next_expect];
+		if (e->keys) {
+			match = match_keys(e->data, e->len, data, len);
+		} else {
+			match = (e->len == len) && !memcmp(e->data, data, len);
+		}
+		if (match) {
+			matched++;
+		} else {
+			mismatches++;
+			if (!quiet) printf("  MISMATCH, expected");
+			else printf("%10.3f ms  report mismatch, expected", ms(sim_cycles));
+			if (e->keys) printf(" keys");
+			for (i=0; i<e->len; i++) printf(" %02x", e->data[i]);
+			if (quiet) printf("\n");
+		}
+		next_expect++;
+	} else if (num_expect) {
+		mismatches++;
+		if (!quiet) printf("  UNEXPECTED");
+		else printf("%10.3f ms  unexpected report\n", ms(sim_cycles));
+	}
+	if (!quiet && !generate) printf("\n");
+}
+
+static void  on_control(const uint8_t *setup, int len, const uint8_t *data)
+{
+	int			i, match;
+
+	if (interactive) {
+		outstanding = 0;
+		if (len < 0) {
+			reply("stall");
+			return;
+		}
+		printf("ok");
+		if (setup[0] & 0x80) {
+			for (i=0; i<len; i++) printf(" %02x", data[i]);
+		}
+		reply("");
+		return;
+	}
+
+	if ((setup[0] & 0x80) && next_ctl < num_ctl) {
+		match = (ctl_len[next_ctl] == len);
+		for (i=0; match && i<len; i++) {
+			if (ctl_care[next_ctl][i] && ctl_expect[next_ctl][i] != data[i]) match = 0;
+		}
+		if (match) {
+			ctl_matched++;
+		} else {
+			mismatches++;
+			printf("%10.3f ms  control %02x/%02x mismatch, expected", ms(sim_cycles), setup[0], setup[1]);
+			if (ctl_len[next_ctl] < 0) printf(" stall");
+			for (i=0; i<ctl_len[next_ctl]; i++) {
+				if (ctl_care[next_ctl][i]) printf(" %02x", ctl_expect[next_ctl][i]);
+				else printf(" --");
+			}
+			printf("\n");
+		}
+		next_ctl++;
+	}
+	if (len < 0) {
+		printf("%10.3f ms  control %02x/%02x stalled\n", ms(sim_cycles), setup[0], setup[1]);
+		return;
+	}
+	if (quiet) return;
+	printf("%10.3f ms  control %02x/%02x, %d bytes", ms(sim_cycles), setup[0], setup[1], len);
+	if (setup[0] & 0x80) {
+		for (i=0; i<len; i++) printf(" %02x", data[i]);
+	}
+	printf("\n");
+}
+
+int  main(int argc, char **argv)
+{
+	int			i;
+
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-q")) quiet = 1;
+		else if (!strcmp(argv[i], "-g")) generate = quiet = 1;
+		else if (!strcmp(argv[i], "-i")) interactive = quiet = 1;
+		else if (!strcmp(argv[i], "-e") && i + 1 < argc) eeprom_name = argv[++i];
+		else break;
+	}
+	if (i != argc - (interactive ? 0 : 1)) {
+		fprintf(stderr, "usage: %s [-q | -g] [-e eeprom-image] trace-file\n"
+				"       %s -i [-e eeprom-image]\n", argv[0], argv[0]);
+		return 2;
+	}
+	load_eeprom();
+	if (!interactive) {
+		trace_name = argv[i];
+		load_trace(trace_name);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+	sim_on_time = on_time;
+	sim_on_report = on_report;
+	sim_on_control = on_control;
+	sim_wakeup = num_events ? events[0].at : end_at;
+	firmware_main();
+	return 2;
+}
@@ -0,0 +1,20 @@
+/*
+ *  host/util/crc16.h
+ *
+ *  Stand-in for <util/crc16.h> used by the host-native build; the C
+ *  equivalents given in the avr-libc documentation.
+ */
+
+#ifndef host_util_crc16_h__
+#define host_util_crc16_h__
+
+#include <stdint.h>
+
+static inline uint16_t  _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+	data ^= crc & 0xff;
+	data ^= data << 4;
+	return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ *  host/util/delay.h
+ *
+ *  Stand-in for <util/delay.h> used by the host-native build.  Busy-wait
+ *  delays advance the simulated clock instead of burning host time.
+ */
+
+#ifndef host_util_delay_h__
+#define host_util_delay_h__
+
+void		sim_delay_us(double us);
+
+#define _delay_us(us)		sim_delay_us(us)
+#define _delay_ms(ms)		sim_delay_us((double)(ms) * 1000.0)
+
+#endif
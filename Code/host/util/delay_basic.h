@@ -0,0 +1,25 @@
+/*
+ *  host/util/delay_basic.h
+ *
+ *  Stand-in for <util/delay_basic.h> used by the host-native build.  The
+ *  counted loops advance the simulated clock by the cycles they would
+ *  take on the AVR.  As there, a count of 0 means 256 or 65536 passes.
+ */
+
+#ifndef host_util_delay_basic_h__
+#define host_util_delay_basic_h__
+
+#include <stdint.h>
+#include "sim.h"
+
+static inline void  _delay_loop_1(uint8_t count)
+{
+	sim_advance((count ? count : 256) * 3);
+}
+
+static inline void  _delay_loop_2(uint16_t count)
+{
+	sim_advance((count ? count : 65536UL) * 4);
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ *  latency.c
+ *
+ *  Key-to-USB latency statistics for the Vic-20 USB keyboard; see latency.h.
+ *
+ *  Everything here runs in the USB interrupts, except latency_drop(),
+ *  which usb_keyboard_queue() calls from the main loop with interrupts
+ *  off, so the counters need no further protection.  Counters stop at
+ *  their maximum rather than wrap.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "latency.h"
+#include "timer.h"
+
+
+typedef char  latencyReportSize[(sizeof(struct latency_report) == LATENCY_REPORT_SIZE) ? 1 : -1];
+
+static struct latency_report	stats;
+static uint32_t					sum_us;			// of the reports in stats.count
+static uint32_t					slack_sum_us;	// of the scans in stats.slack_count
+
+
+static void  bump(uint16_t *counter)
+{
+	if (*counter != 0xffff)  (*counter)++;
+}
+
+
+
+/*
+ *  latency_record      time a report committed now, stamped at timer_micros() == stamp
+ */
+void  latency_record(uint32_t stamp)
+{
+	uint32_t		us = timer_micros() - stamp;
+	uint8_t			b;
+
+	if (us > LATENCY_TIMEOUT_US)
+	{
+		bump(&stats.timeouts);
+		return;
+	}
+	if (stats.count == 0xffff)  return;			// keep the average consistent with the count
+	stats.count++;
+	sum_us += us;
+	if ((stats.count == 1) || (us < stats.min_us))  stats.min_us = us;
+	if (us > stats.max_us)  stats.max_us = us;
+	b = (us / LATENCY_BUCKET_US < LATENCY_BUCKETS) ? us / LATENCY_BUCKET_US : LATENCY_BUCKETS - 1;
+	bump(&stats.bucket[b]);
+}
+
+
+
+/*
+ *  latency_drop      count a queued report that never reached the endpoint
+ */
+void  latency_drop(void)
+{
+	bump(&stats.dropped);
+}
+
+
+
+/*
+ *  latency_slack      count the slack timer_sof() found at a start of frame
+ */
+void  latency_slack(uint16_t us)
+{
+	if (us == TIMER_SOF_IDLE)  return;
+	if (us == TIMER_SOF_LATE)
+	{
+		bump(&stats.slack_late);
+		return;
+	}
+	if (stats.slack_count == 0xffff)  return;
+	stats.slack_count++;
+	slack_sum_us += us;
+	if ((stats.slack_count == 1) || (us < stats.slack_min_us))  stats.slack_min_us = us;
+	if (us > stats.slack_max_us)  stats.slack_max_us = us;
+}
+
+
+
+/*
+ *  latency_reset      clear all statistics
+ */
+void  latency_reset(void)
+{
+	memset(&stats, 0, sizeof(stats));
+	sum_us = 0;
+	slack_sum_us = 0;
+}
+
+
+
+/*
+ *  latency_report      write the feature report to buf
+ */
+void  latency_report(uint8_t *buf)
+{
+	const uint16_t	*p = &stats.count;
+	uint8_t			n;
+
+	stats.avg_us = stats.count ? sum_us / stats.count : 0;
+	stats.slack_avg_us = stats.slack_count ? slack_sum_us / stats.slack_count : 0;
+	stats.bucket_us = LATENCY_BUCKET_US;
+	for (n=0; n<LATENCY_REPORT_SIZE/2; n++, p++)
+	{
+		*buf++ = *p;
+		*buf++ = *p >> 8;
+	}
+}
@@ -0,0 +1,64 @@
+/*
+ *  latency.h
+ *
+ *  Key-to-USB latency statistics for the Vic-20 USB keyboard.
+ *
+ *  scanKeyboard() timestamps the scan that finds a debounced edge, and
+ *  the report that scan sends carries the stamp through the report
+ *  queue.  When the start of frame interrupt commits the report to an
+ *  endpoint bank, latency_record() adds the time since the stamp to a
+ *  histogram of LATENCY_BUCKETS buckets, LATENCY_BUCKET_US wide; the
+ *  last bucket also takes everything longer.  A report still waiting
+ *  after LATENCY_TIMEOUT_US is counted as timed out instead, and a
+ *  queued report that is replaced or flushed before it reaches the
+ *  endpoint is counted as dropped.
+ *
+ *  timer_sof() also hands latency_slack() the time from the end of each
+ *  scan to the start of frame that follows it, the margin the scan
+ *  phase leaves, and counts the frames that began while a scan was
+ *  still running, whose report then waited a whole frame longer.
+ *
+ *  The host reads the statistics as the keyboard interface's HID feature
+ *  report, laid out as struct latency_report, and clears them by writing
+ *  the feature report.  The time the host then takes to poll the bank
+ *  is not included; see host/sim_main.c for the full key-to-host figure.
+ */
+
+#ifndef latency_h__
+#define latency_h__
+
+#include <stdint.h>
+
+#define  LATENCY_BUCKETS			16
+#define  LATENCY_BUCKET_US			250
+#define  LATENCY_TIMEOUT_US			50000UL		/* as long as the old blocking send waited */
+
+/*
+ *  The feature report, all fields little endian.  min, avg and max only
+ *  cover the reports counted in count.
+ */
+struct latency_report {
+	uint16_t		count;						// reports timed
+	uint16_t		min_us;
+	uint16_t		avg_us;
+	uint16_t		max_us;
+	uint16_t		dropped;
+	uint16_t		timeouts;
+	uint16_t		bucket_us;					// LATENCY_BUCKET_US
+	uint16_t		bucket[LATENCY_BUCKETS];
+	uint16_t		slack_count;				// scans followed by a start of frame
+	uint16_t		slack_min_us;
+	uint16_t		slack_avg_us;
+	uint16_t		slack_max_us;
+	uint16_t		slack_late;					// frames that began during a scan
+};
+
+#define  LATENCY_REPORT_SIZE		56			/* sizeof(struct latency_report), for the descriptor */
+
+void		latency_record(uint32_t stamp);		// a stamped report was committed
+void		latency_drop(void);					// a queued report was lost
+void		latency_slack(uint16_t us);			// timer_sof() result
+void		latency_reset(void);
+void		latency_report(uint8_t *buf);		// fill LATENCY_REPORT_SIZE bytes
+
+#endif
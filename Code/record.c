@@ -0,0 +1,135 @@
+/*
+ *  record.c
+ *
+ *  Key edge recorder for the Vic-20 USB keyboard; see record.h.
+ *
+ *  record_scan() runs in the main loop and is the only writer of head;
+ *  record_read() runs in the USB interrupt and is the only writer of
+ *  tail, so the ring needs no locking.  record_start() only asks for a
+ *  restart, which the next scan carries out, as the interrupt may have
+ *  cut into record_scan().
+ */
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "record.h"
+#include "timer.h"
+
+
+#define  RECORD_ROWS				9			/* as NUM_ROWS in Vic20_usb_keyboard.c */
+
+struct record_entry {
+	uint32_t		us;
+	uint8_t			key;
+	uint8_t			flags;
+};
+
+volatile uint8_t				record_on;
+
+static struct record_entry		ring[RECORD_EDGES];
+static volatile uint8_t			head;			// next entry to write, free running
+static volatile uint8_t			tail;			// next entry to read, free running
+static volatile uint8_t			restart;		// record_start() not carried out yet
+static uint8_t					lost;			// edges dropped since the last one stored
+static uint8_t					lastRows[RECORD_ROWS];
+static uint32_t					startUs;
+
+
+
+/*
+ *  record_start      clear the ring and start recording from the next scan
+ */
+void  record_start(void)
+{
+	restart = 1;
+	record_on = 1;
+}
+
+
+
+/*
+ *  record_stop      stop recording; what is in the ring can still be read
+ */
+void  record_stop(void)
+{
+	record_on = 0;
+}
+
+
+
+/*
+ *  record_scan      log the switches that changed since the last scan
+ *
+ *  rows[] holds one raw sample per row, a clear bit for a closed switch.
+ */
+void  record_scan(const uint8_t *rows, uint8_t count)
+{
+	uint8_t			r, c;
+	uint8_t			changed;
+	uint8_t			intr_state;
+	uint32_t		now = timer_micros();
+	struct record_entry	*e;
+
+	if (count > RECORD_ROWS)  count = RECORD_ROWS;
+	if (restart)
+	{
+		intr_state = SREG;
+		cli();
+		tail = head;
+		restart = 0;
+		SREG = intr_state;
+		lost = 0;
+		startUs = now;
+		for (r=0; r<RECORD_ROWS; r++)  lastRows[r] = 0xff;
+	}
+
+	for (r=0; r<count; r++)
+	{
+		changed = rows[r] ^ lastRows[r];
+		if (!changed)  continue;
+		lastRows[r] = rows[r];
+		for (c=0; changed; c++, changed >>= 1)
+		{
+			if (!(changed & 1))  continue;
+			if ((uint8_t)(head - tail) == RECORD_EDGES)
+			{
+				if (lost != 0xff)  lost++;
+				continue;
+			}
+			e = &ring[head & (RECORD_EDGES - 1)];
+			e->us = now - startUs;
+			e->key = (r << 4) | c;
+			e->flags = ((rows[r] & (1<<c)) ? 0 : RECORD_DOWN) | (lost ? RECORD_LOST : 0);
+			lost = 0;
+			head++;								// only now can record_read() see it
+		}
+	}
+}
+
+
+
+/*
+ *  record_read      move the oldest edges to buf; called from the USB interrupt
+ *
+ *  Returns the number of bytes stored, a multiple of RECORD_ENTRY_SIZE.
+ */
+uint8_t  record_read(uint8_t *buf)
+{
+	uint8_t			n = 0;
+	struct record_entry	*e;
+
+	if (restart)  return  0;					// what is left is from the last recording
+	while ((n < RECORD_READ_SIZE) && (tail != head))
+	{
+		e = &ring[tail & (RECORD_EDGES - 1)];
+		buf[n++] = e->us;
+		buf[n++] = e->us >> 8;
+		buf[n++] = e->us >> 16;
+		buf[n++] = e->us >> 24;
+		buf[n++] = e->key;
+		buf[n++] = e->flags;
+		tail++;
+	}
+	return  n;
+}
@@ -0,0 +1,52 @@
+/*
+ *  record.h
+ *
+ *  Key edge recorder for the Vic-20 USB keyboard.
+ *
+ *  While the host has recording on, scanKeyboard() hands every raw
+ *  matrix sample to record_scan(), which logs each switch that closed or
+ *  opened since the sample before, with the time of the scan, in a ring
+ *  of RECORD_EDGES entries.  The samples are taken before the debounce,
+ *  so contact bounce is kept.  The first scan compares against an open
+ *  matrix, so keys already held when recording starts are logged too.
+ *
+ *  The host starts and stops recording and drains the ring with the
+ *  CONFIG_RECORD and CONFIG_RECORD_READ vendor requests (config.h).
+ *  tools/vic20cfg record writes the edges out in the trace format of
+ *  host/sim_main.c, so real typing can be replayed against the
+ *  host-native build as a regression trace.  With recording off a scan
+ *  costs one test of record_on.
+ *
+ *  This header is shared with the host tools, so it only uses <stdint.h>.
+ */
+
+#ifndef record_h__
+#define record_h__
+
+#include <stdint.h>
+
+#define  RECORD_EDGES				64			/* ring entries, a power of two */
+
+/*
+ *  CONFIG_RECORD_READ returns up to RECORD_READ_EDGES entries of
+ *  RECORD_ENTRY_SIZE bytes, oldest first, and removes them from the
+ *  ring; ask for RECORD_READ_SIZE bytes, so none is lost.  Each entry is
+ *  the time of the scan in us since recording started (4 bytes, little
+ *  endian, wrapping), the switch as CONFIG_KEY(0, row, col) and
+ *  RECORD_* flags.
+ */
+#define  RECORD_ENTRY_SIZE			6
+#define  RECORD_READ_EDGES			8
+#define  RECORD_READ_SIZE			(RECORD_READ_EDGES * RECORD_ENTRY_SIZE)
+
+#define  RECORD_DOWN				0x01		/* the switch closed, else it opened */
+#define  RECORD_LOST				0x80		/* the ring overflowed before this edge */
+
+extern volatile uint8_t		record_on;
+
+void		record_start(void);
+void		record_stop(void);
+void		record_scan(const uint8_t *rows, uint8_t count);	// raw samples, active low
+uint8_t		record_read(uint8_t *buf);			// fill RECORD_READ_SIZE bytes, returns the length
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ *  report.c
+ *
+ *  Keyboard report builder for the Vic-20 USB keyboard; see report.h.
+ */
+
+#include <stdint.h>
+#include "usb_keyboard.h"
+#include "report.h"
+
+
+static uint8_t		lastModifiers;					// the report last sent, see report_changed()
+static uint8_t		lastKeys[REPORT_KEYS];
+static uint8_t		lastBitmap[KEYBOARD_BITMAP_SIZE];
+
+
+// is usage k in the list?
+static uint8_t  isHeld(const uint8_t *held, uint8_t count, uint8_t k)
+{
+	while (count--)
+	{
+		if (*held++ == k)  return  1;
+	}
+	return  0;
+}
+
+
+
+/*
+ *  report_build      update keyboard_keys[] and keyboard_bitmap[] from the keys held now
+ *
+ *  held[] lists the usage of every held key in scan order; zero entries
+ *  and duplicates are ignored.  The bitmap simply gets a bit set for
+ *  every held usage.  For the slots, those whose key is no longer held are
+ *  freed first, then every held key that is not already in a slot gets
+ *  the lowest free one.  If a key finds no free slot the report is in
+ *  rollover and every slot is set to KEY_errorRollOver; the next build
+ *  starts from empty slots again.
+ */
+void  report_build(const uint8_t *held, uint8_t count)
+{
+	uint8_t			i, s, k;
+
+	for (i=0; i<KEYBOARD_BITMAP_SIZE; i++)  keyboard_bitmap[i] = 0;
+	for (i=0; i<count; i++)
+	{
+		k = held[i];
+		if (k && k < KEYBOARD_BITMAP_SIZE * 8)  keyboard_bitmap[k >> 3] |= (1 << (k & 7));
+	}
+
+	for (s=0; s<REPORT_KEYS; s++)
+	{
+		if (!isHeld(held, count, keyboard_keys[s]))  keyboard_keys[s] = 0;
+	}
+
+	for (i=0; i<count; i++)
+	{
+		k = held[i];
+		if (k == 0)  continue;
+		for (s=0; s<REPORT_KEYS; s++)			// already in a slot?
+		{
+			if (keyboard_keys[s] == k)  break;
+		}
+		if (s < REPORT_KEYS)  continue;
+		for (s=0; s<REPORT_KEYS; s++)			// take the lowest free slot
+		{
+			if (keyboard_keys[s] == 0)  break;
+		}
+		if (s == REPORT_KEYS)					// no room, report rollover
+		{
+			for (s=0; s<REPORT_KEYS; s++)  keyboard_keys[s] = KEY_errorRollOver;
+			return;
+		}
+		keyboard_keys[s] = k;
+	}
+}
+
+
+
+/*
+ *  report_changed      has the report changed since it was last sent?
+ *
+ *  Compares keyboard_modifier_keys, keyboard_keys[] and keyboard_bitmap[]
+ *  with the copy taken the last time this returned 1.  Both report
+ *  formats are compared, so the answer holds whichever protocol the host
+ *  has selected.  Returns 1, and takes a new copy, if anything differs;
+ *  the caller is then expected to send the report.
+ */
+uint8_t  report_changed(void)
+{
+	uint8_t			i, changed;
+
+	changed = (keyboard_modifier_keys != lastModifiers);
+	for (i=0; i<REPORT_KEYS; i++)
+	{
+		if (keyboard_keys[i] != lastKeys[i])  changed = 1;
+	}
+	for (i=0; i<KEYBOARD_BITMAP_SIZE; i++)
+	{
+		if (keyboard_bitmap[i] != lastBitmap[i])  changed = 1;
+	}
+	if (!changed)  return  0;
+
+	lastModifiers = keyboard_modifier_keys;
+	for (i=0; i<REPORT_KEYS; i++)  lastKeys[i] = keyboard_keys[i];
+	for (i=0; i<KEYBOARD_BITMAP_SIZE; i++)  lastBitmap[i] = keyboard_bitmap[i];
+	return  1;
+}
@@ -0,0 +1,28 @@
+/*
+ *  report.h
+ *
+ *  Keyboard report builder for the Vic-20 USB keyboard.
+ *
+ *  report_build() turns the set of keys currently held into the bitmap
+ *  of the N-key rollover report, keyboard_bitmap[], and the six
+ *  keyboard_keys[] slots of the boot keyboard report.  A key keeps the
+ *  slot it was given for as long as it is held, new keys take the lowest
+ *  free slot, and if more than six distinct keys are held every slot
+ *  reports KEY_errorRollOver, as the HID spec asks.
+ *
+ *  report_changed() tells whether the report built since the last call
+ *  differs from the one last handed to the USB code, so a scan that ends
+ *  up where it started sends nothing.
+ */
+
+#ifndef report_h__
+#define report_h__
+
+#include <stdint.h>
+
+#define  REPORT_KEYS			6				/* key slots in the boot report */
+
+void		report_build(const uint8_t *held, uint8_t count);
+uint8_t		report_changed(void);
+
+#endif
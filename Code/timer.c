@@ -0,0 +1,326 @@
+/*
+ *  timer.c
+ *
+ *  Scan scheduler and system clock for the Vic-20 USB keyboard.
+ *
+ *  Timer1 counts at F_CPU/8 (2 MHz on the Teensy++ 2.0) and clears on a
+ *  compare match with OCR1A, giving one interrupt per scan period.  The
+ *  interrupt only updates the clock and sets a flag; the scan itself runs
+ *  in the main loop, which spends the rest of the period in idle sleep.
+ *  Idle sleep keeps the USB controller and Timer1 running, so either one
+ *  can wake the CPU.
+ *
+ *  If a scan overruns its period, the pending tick is not counted twice;
+ *  the next scan simply starts right away.
+ *
+ *  The period is a whole number of microseconds, 1000000 / rate truncated,
+ *  so for a rate that does not divide 1000000 the period comes out a
+ *  little short and the scans run at or slightly above the requested
+ *  rate; the clock stays exact either way.
+ *
+ *  At each start of frame timer_sof() moves the compare match of the
+ *  period then running, so the tick after it comes phase microseconds
+ *  before a start of frame; the interrupt puts OCR1A back once that
+ *  period is over, and counts the period's real length in the clock.
+ *  A scan rate that neither divides nor is a multiple of 1000 Hz has no
+ *  fixed phase to the frames and runs free.
+ *
+ *  While the host has suspended the bus the main loop sleeps in
+ *  power-down instead, woken by the watchdog in interrupt mode.  Timer1
+ *  and the clock stand still meanwhile.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include "timer.h"
+
+
+#define  TIMER_PRESCALE			8
+#define  TIMER_TICKS_PER_US		(F_CPU / TIMER_PRESCALE / 1000000UL)
+#define  TIMER_TOP(us)			((us) * TIMER_TICKS_PER_US - 1)
+#define  TIMER_MAX_US			(0x10000UL / TIMER_TICKS_PER_US)
+#define  TIMER_LEAD_US			50					/* a moved compare match stays this far ahead */
+#define  FRAME_US				1000
+
+#if (1000000UL % SCAN_RATE_HZ) != 0
+#error "SCAN_RATE_HZ must divide 1000000"
+#endif
+#if (SCAN_RATE_HZ < SCAN_RATE_MIN_HZ) || (SCAN_RATE_HZ > SCAN_RATE_MAX_HZ)
+#error "SCAN_RATE_HZ is out of range for Timer1 at F_CPU/8"
+#endif
+
+
+static volatile uint32_t	micros_base;		// clock at the last compare match
+static volatile uint32_t	millis_count;
+static volatile uint16_t	millis_frac;		// microseconds not yet counted in millis_count
+static volatile uint8_t		tick_pending;
+static volatile uint16_t	period_us = SCAN_PERIOD_US;
+static volatile uint16_t	tick_us = SCAN_PERIOD_US;	// length of the period now running
+static uint16_t				phase_us = SCAN_PHASE_US;
+static volatile uint16_t	lock_frame;			// ticks repeat every this many us against the frames, 0 if not
+static volatile uint16_t	lock_left;			// time from a start of frame to the next tick, when locked
+static volatile uint8_t		scanning;			// the main loop is between a tick and timer_wait_tick()
+static volatile uint8_t		scan_ended;			// ...and has finished one since the last frame,
+static volatile uint32_t	scan_end;			// at this timer_micros() time
+
+
+
+// work out lock_frame and lock_left for the current period and phase
+static void  set_lock(void)
+{
+	uint16_t		frame;
+
+	if (FRAME_US % period_us == 0)  frame = period_us;		// several ticks per frame
+	else if (period_us % FRAME_US == 0)  frame = FRAME_US;	// several frames per tick
+	else  frame = 0;
+	lock_left = frame ? frame - phase_us % frame : 0;
+	lock_frame = frame;
+}
+
+
+
+/*
+ *  timer_init      start Timer1 as the scan tick
+ *
+ *  Interrupts must be enabled (sei) for the tick to run.
+ */
+void  timer_init(void)
+{
+	TCCR1A = 0;
+	OCR1A = TIMER_TOP(period_us);
+	TIMSK1 = (1<<OCIE1A);
+	TCCR1B = (1<<WGM12) | (1<<CS11);			// CTC, top = OCR1A, clk/8
+	set_lock();
+	set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+
+
+/*
+ *  timer_set_rate      change the scan rate, clamped to what Timer1 can count
+ *
+ *  The current period restarts from 0, so the next tick comes one full
+ *  new period from now.  Call it from the main loop just after a tick,
+ *  while no compare match can be pending.
+ */
+void  timer_set_rate(uint16_t hz)
+{
+	uint8_t			intr_state;
+	uint16_t		count;
+
+	if (hz < SCAN_RATE_MIN_HZ)  hz = SCAN_RATE_MIN_HZ;
+	if (hz > SCAN_RATE_MAX_HZ)  hz = SCAN_RATE_MAX_HZ;
+	if (1000000UL / hz == period_us)  return;
+	intr_state = SREG;
+	cli();
+	count = TCNT1;								// count the part period already run
+	micros_base += count / TIMER_TICKS_PER_US;
+	millis_frac += count / TIMER_TICKS_PER_US;
+	period_us = 1000000UL / hz;
+	tick_us = period_us;
+	OCR1A = TIMER_TOP(period_us);
+	TCNT1 = 0;
+	set_lock();
+	SREG = intr_state;
+}
+
+
+
+/*
+ *  timer_period_us      the scan period in microseconds
+ */
+uint16_t  timer_period_us(void)
+{
+	return  period_us;
+}
+
+
+
+/*
+ *  timer_set_phase      how long before a start of frame a scan should start
+ *
+ *  Long enough for a scan to finish, with its report, before the frame
+ *  begins; the slack timer_sof() returns shows how much is to spare.
+ */
+void  timer_set_phase(uint16_t us)
+{
+	uint8_t			intr_state;
+
+	intr_state = SREG;
+	cli();
+	phase_us = (us > SCAN_PHASE_MAX_US) ? SCAN_PHASE_MAX_US : us;
+	set_lock();
+	SREG = intr_state;
+}
+
+
+
+/*
+ *  timer_sof      lock the ticks to the USB frames; call from the start of frame interrupt
+ *
+ *  Returns the time in microseconds from the end of the last scan to now,
+ *  or TIMER_SOF_LATE if a scan is still running, its report too late for
+ *  this frame, or TIMER_SOF_IDLE if no scan has ended since the last call.
+ */
+uint16_t  timer_sof(void)
+{
+	uint16_t		slack = TIMER_SOF_IDLE;
+	uint16_t		frame = lock_frame;
+	uint16_t		count, left;
+	int16_t			error;
+	uint32_t		us;
+
+	if (scanning)
+	{
+		slack = TIMER_SOF_LATE;
+	}
+	else if (scan_ended)
+	{
+		us = timer_micros() - scan_end;
+		slack = (us < TIMER_SOF_LATE) ? us : TIMER_SOF_LATE - 1;
+	}
+	scan_ended = 0;
+
+	if (!frame)  return  slack;
+	if (TIFR1 & (1<<OCF1A))  return  slack;				// the tick interrupt is about to run
+	count = TCNT1 / TIMER_TICKS_PER_US;
+	left = tick_us - count;								// until the next tick
+	error = (int16_t)((left + frame - lock_left) % frame);
+	if (error > (int16_t)(frame / 2))  error -= frame;
+	if (error == 0)  return  slack;
+	left -= error;
+	if ((int16_t)left < TIMER_LEAD_US)  left += frame;
+	if ((uint32_t)count + left > TIMER_MAX_US)  return  slack;
+	tick_us = count + left;
+	OCR1A = TIMER_TOP(tick_us);
+	return  slack;
+}
+
+
+
+ISR(TIMER1_COMPA_vect)
+{
+	micros_base += tick_us;
+	millis_frac += tick_us;
+	while (millis_frac >= 1000)
+	{
+		millis_frac -= 1000;
+		millis_count++;
+	}
+	if (tick_us != period_us)					// timer_sof() moved this one
+	{
+		tick_us = period_us;
+		OCR1A = TIMER_TOP(period_us);
+	}
+	tick_pending = 1;
+}
+
+
+
+/*
+ *  timer_wait_tick      sleep until the next scan tick
+ *
+ *  Interrupts are disabled while the flag is tested so a tick cannot
+ *  slip in between the test and the sleep instruction; sei() takes
+ *  effect only after the following instruction, so the CPU is already
+ *  asleep when the pending interrupt wakes it.
+ */
+void  timer_wait_tick(void)
+{
+	uint32_t		now = timer_micros();
+
+	cli();
+	scanning = 0;
+	scan_ended = 1;
+	scan_end = now;
+	while (!tick_pending)
+	{
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+		cli();
+	}
+	tick_pending = 0;
+	scanning = 1;
+	sei();
+}
+
+
+
+/*
+ *  timer_power_down      sleep in power-down for about 16 ms
+ *
+ *  Power-down stops every clock but the watchdog oscillator, so only the
+ *  watchdog interrupt, set here to its shortest period, or an
+ *  asynchronous interrupt such as the USB controller's WAKEUPI wakes the
+ *  CPU.  The watchdog is off again on return, and Timer1 carries on
+ *  from where it stopped.
+ */
+void  timer_power_down(void)
+{
+	cli();
+	wdt_reset();
+	WDTCSR = (1<<WDCE) | (1<<WDE);
+	WDTCSR = (1<<WDIE);							// interrupt only, 2K cycles: 16 ms
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+	cli();
+	wdt_reset();
+	MCUSR &= ~(1<<WDRF);
+	WDTCSR = (1<<WDCE) | (1<<WDE);
+	WDTCSR = 0;
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sei();
+}
+
+
+
+ISR(WDT_vect)
+{
+}
+
+
+
+/*
+ *  timer_micros      microseconds since timer_init(), wraps after ~71 minutes
+ */
+uint32_t  timer_micros(void)
+{
+	uint32_t		base;
+	uint16_t		count;
+	uint8_t			intr_state;
+
+	intr_state = SREG;
+	cli();
+	base = micros_base;
+	count = TCNT1;
+	if ((TIFR1 & (1<<OCF1A)) && (count < OCR1A))	// wrapped, interrupt not yet run
+	{
+		base += tick_us;
+	}
+	SREG = intr_state;
+	return  base + count / TIMER_TICKS_PER_US;
+}
+
+
+
+/*
+ *  timer_millis      milliseconds since timer_init(), wraps after ~49 days
+ */
+uint32_t  timer_millis(void)
+{
+	uint32_t		ms;
+	uint8_t			intr_state;
+
+	intr_state = SREG;
+	cli();
+	ms = millis_count;
+	SREG = intr_state;
+	return  ms;
+}
@@ -0,0 +1,51 @@
+/*
+ *  timer.h
+ *
+ *  Scan scheduler and system clock for the Vic-20 USB keyboard.
+ *
+ *  Timer1 runs in CTC mode and interrupts SCAN_RATE_HZ times per second,
+ *  or at the rate last set with timer_set_rate().  Each interrupt advances
+ *  the millisecond/microsecond clock and marks a scan as due; the main
+ *  loop sleeps in timer_wait_tick() until then.
+ *
+ *  While the host sends start of frame packets, timer_sof() locks the
+ *  ticks to the 1 ms USB frames, so a scan starts timer_set_phase()
+ *  microseconds before a frame begins and its report is in the endpoint
+ *  bank for that frame's poll.  It also measures the slack, from the end
+ *  of the last scan to the start of frame.
+ */
+
+#ifndef timer_h__
+#define timer_h__
+
+#include <stdint.h>
+
+#ifndef  SCAN_RATE_HZ
+#define  SCAN_RATE_HZ			1000				/* matrix scans per second */
+#endif
+
+#define  SCAN_PERIOD_US			(1000000UL / SCAN_RATE_HZ)
+
+#define  SCAN_RATE_MIN_HZ		31					/* longest period Timer1 can count */
+#define  SCAN_RATE_MAX_HZ		8000
+
+#ifndef  SCAN_PHASE_US
+#define  SCAN_PHASE_US			200					/* scan start before start of frame */
+#endif
+
+#define  SCAN_PHASE_MAX_US		999
+
+#define  TIMER_SOF_IDLE			0xffff				/* timer_sof(): no scan since the last frame */
+#define  TIMER_SOF_LATE			0xfffe				/* a scan was still running */
+
+void		timer_init(void);					// start the scan tick
+void		timer_set_rate(uint16_t hz);		// change the scan rate
+uint16_t	timer_period_us(void);				// current scan period
+void		timer_set_phase(uint16_t us);		// scan start before start of frame
+uint16_t	timer_sof(void);					// lock to a start of frame, returns the slack
+void		timer_wait_tick(void);				// sleep until the next scan is due
+void		timer_power_down(void);				// deep sleep for a watchdog period
+uint32_t	timer_millis(void);					// milliseconds since timer_init()
+uint32_t	timer_micros(void);					// microseconds since timer_init()
+
+#endif
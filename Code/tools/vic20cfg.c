@@ -0,0 +1,578 @@
+/*
+ *  tools/vic20cfg.c
+ *
+ *  Command line client for the keyboard's runtime settings (config.h).
+ *
+ *  Usage:  vic20cfg [-d device | -s sim-command] command [argument ...]
+ *          vic20cfg [-d device | -s sim-command] -b < commands
+ *
+ *	status						what is saved, unsaved changes, save progress
+ *	get [param]					print one parameter, or all of them
+ *	set <param> <value>			change a parameter
+ *	key <layer> <row> <col> [code]
+ *								print or change one keymap cell
+ *	dump [layer]				print the keymap of one layer, or all
+ *	save						write the settings to EEPROM and wait for it
+ *	defaults					go back to the build-time settings
+ *	latency [reset]				print the key-to-USB latency histogram
+ *								(latency.h), or clear it
+ *	record <seconds>			record the key edges for this long and
+ *								print them as a trace (record.h)
+ *
+ *  Parameters are rate (scan rate in Hz), debounce (eager, deferred or
+ *  integrator), press and release (debounce windows in ms) and phase
+ *  (how many us before each USB frame a scan starts).  Changes
+ *  take effect at once and are lost at reset unless saved.  Numbers may
+ *  be given in decimal or, with 0x, in hex.  With -b the commands are
+ *  read from standard input, one per line.
+ *
+ *  record prints one line per switch that closed or opened, as the
+ *  keyboard's raw scans saw it, in the trace format of host/sim_main.c,
+ *  starting RECORD_START_MS into the trace so the simulated host has
+ *  configured the keyboard by then.  Run the trace through the simulator
+ *  with -g to add the reports it gives.
+ *
+ *  The keyboard is found by its vendor and product ID and opened through
+ *  usbdevfs, which needs write access to its node in /dev/bus/usb; -d
+ *  names the node instead.  The latency histogram is the keyboard's HID
+ *  feature report, which goes through the usbhid driver's /dev/hidraw
+ *  node instead, as usbdevfs cannot reach an interface another driver
+ *  has claimed.  With -s the requests go to the host-native
+ *  simulator instead, started as "sim-command" in interactive mode (see
+ *  host/sim_main.c), which is how make host-check tests this tool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/hidraw.h>
+#include "config.h"
+#include "latency.h"
+#include "record.h"
+
+
+#define VENDOR_ID			0x16C0			/* as in usb_keyboard.c */
+#define PRODUCT_ID			0x047C
+#define TIMEOUT_MS			1000
+#define SAVE_TIMEOUT_MS		10000
+#define SAVE_POLL_MS		50
+#define RECORD_POLL_MS		20				/* the ring holds RECORD_EDGES edges */
+#define RECORD_START_MS		1200
+
+#define HID_GET_REPORT		0x01			/* as in usb_keyboard.c */
+#define HID_SET_REPORT		0x09
+#define HID_REPORT_FEATURE	3
+#define KEYBOARD_INTERFACE	0
+
+#define XFER_STALL			-1
+#define XFER_ERROR			-2
+
+static const char	*param_names[CONFIG_NUM_PARAMS] = {"rate", "debounce", "press", "release", "phase"};
+static const char	*debounce_names[] = {"eager", "deferred", "integrator"};
+#define NUM_DEBOUNCE		(sizeof(debounce_names) / sizeof(debounce_names[0]))
+
+static int			usb_fd = -1, hid_fd = -1;
+static FILE			*sim_in, *sim_out;
+
+
+/*
+ *  Transports.  xfer() runs one control request and returns the number
+ *  of bytes read or written, XFER_STALL or XFER_ERROR; wait_ms() lets
+ *  time pass on the keyboard's side.
+ */
+static int  usb_xfer(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t len)
+{
+	struct usbdevfs_ctrltransfer	ctrl;
+	int								n;
+
+	ctrl.bRequestType = type;
+	ctrl.bRequest = request;
+	ctrl.wValue = value;
+	ctrl.wIndex = index;
+	ctrl.wLength = len;
+	ctrl.timeout = TIMEOUT_MS;
+	ctrl.data = data;
+	n = ioctl(usb_fd, USBDEVFS_CONTROL, &ctrl);
+	if (n < 0) return (errno == EPIPE) ? XFER_STALL : XFER_ERROR;
+	return n;
+}
+
+static int  sim_xfer(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t len)
+{
+	char		line[512], *p, *q;
+	long		v;
+	int			n = 0;
+
+	fprintf(sim_in, "control %02x %02x %04x %04x %04x\n", type, request, value, index, len);
+	fflush(sim_in);
+	if (!fgets(line, sizeof(line), sim_out)) return XFER_ERROR;
+	if (!strncmp(line, "stall", 5)) return XFER_STALL;
+	if (strncmp(line, "ok", 2)) return XFER_ERROR;
+	for (p = line + 2; (v = strtol(p, &q, 16)), q != p; p = q) {
+		if (n < len) data[n++] = v;
+	}
+	return n;
+}
+
+static int  xfer(uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t len)
+{
+	if (sim_in) return sim_xfer(type, request, value, index, data, len);
+	return usb_xfer(type, request, value, index, data, len);
+}
+
+static void  wait_ms(unsigned ms)
+{
+	char		line[64];
+
+	if (!sim_in) {
+		usleep(ms * 1000);
+		return;
+	}
+	fprintf(sim_in, "wait %u\n", ms);
+	fflush(sim_in);
+	if (!fgets(line, sizeof(line), sim_out)) {
+		fprintf(stderr, "vic20cfg: simulator exited\n");
+		exit(1);
+	}
+}
+
+static void  open_sim(const char *command)
+{
+	int			to[2], from[2];
+	pid_t		pid;
+
+	if (pipe(to) || pipe(from)) {
+		perror("pipe");
+		exit(1);
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		dup2(to[0], 0);
+		dup2(from[1], 1);
+		close(to[0]); close(to[1]);
+		close(from[0]); close(from[1]);
+		execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+		_exit(127);
+	}
+	close(to[0]);
+	close(from[1]);
+	sim_in = fdopen(to[1], "w");
+	sim_out = fdopen(from[0], "r");
+}
+
+static void  close_sim(void)
+{
+	int			status;
+
+	if (!sim_in) return;
+	fclose(sim_in);							// end of input ends the run
+	fclose(sim_out);
+	sim_in = NULL;
+	if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "vic20cfg: simulator failed\n");
+		exit(1);
+	}
+}
+
+// read a sysfs attribute as a hex or decimal number
+static long  sysfs_number(const char *dir, const char *name, int base)
+{
+	char		path[512];
+	FILE		*f;
+	long		v = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (!(f = fopen(path, "r"))) return -1;
+	if (fscanf(f, base == 16 ? "%lx" : "%ld", &v) != 1) v = -1;
+	fclose(f);
+	return v;
+}
+
+static void  open_usb(const char *device)
+{
+	char		path[64], dir[512];
+	glob_t		g;
+	size_t		i;
+
+	if (!device) {
+		if (glob("/sys/bus/usb/devices/*", 0, NULL, &g) == 0) {
+			for (i=0; i<g.gl_pathc && !device; i++) {
+				snprintf(dir, sizeof(dir), "%s", g.gl_pathv[i]);
+				if (sysfs_number(dir, "idVendor", 16) != VENDOR_ID) continue;
+				if (sysfs_number(dir, "idProduct", 16) != PRODUCT_ID) continue;
+				snprintf(path, sizeof(path), "/dev/bus/usb/%03ld/%03ld",
+						 sysfs_number(dir, "busnum", 10), sysfs_number(dir, "devnum", 10));
+				device = path;
+			}
+			globfree(&g);
+		}
+		if (!device) {
+			fprintf(stderr, "vic20cfg: no keyboard (%04x:%04x) found\n", VENDOR_ID, PRODUCT_ID);
+			exit(1);
+		}
+	}
+	usb_fd = open(device, O_RDWR);
+	if (usb_fd < 0) {
+		perror(device);
+		exit(1);
+	}
+}
+
+
+// the keyboard's hidraw node, for the feature report
+static void  open_hid(void)
+{
+	char		path[512], line[128];
+	glob_t		g;
+	size_t		i;
+	FILE		*f;
+	unsigned	bus, vendor, product;
+
+	if (glob("/sys/class/hidraw/*", 0, NULL, &g) == 0) {
+		for (i=0; i<g.gl_pathc && hid_fd < 0; i++) {
+			snprintf(path, sizeof(path), "%s/device/uevent", g.gl_pathv[i]);
+			if (!(f = fopen(path, "r"))) continue;
+			while (fgets(line, sizeof(line), f)) {
+				if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) != 3) continue;
+				if (vendor != VENDOR_ID || product != PRODUCT_ID) continue;
+				snprintf(path, sizeof(path), "/dev/%s", strrchr(g.gl_pathv[i], '/') + 1);
+				hid_fd = open(path, O_RDWR);
+				if (hid_fd < 0) {
+					perror(path);
+					exit(1);
+				}
+				break;
+			}
+			fclose(f);
+		}
+		globfree(&g);
+	}
+	if (hid_fd < 0) {
+		fprintf(stderr, "vic20cfg: no keyboard (%04x:%04x) hidraw node found\n", VENDOR_ID, PRODUCT_ID);
+		exit(1);
+	}
+}
+
+/*
+ *  Read (set = 0) or write the feature report, LATENCY_REPORT_SIZE bytes.
+ *  The report has no report ID, so hidraw's leading ID byte is zero.
+ */
+static int  feature_xfer(int set, uint8_t *data)
+{
+	uint8_t		buf[LATENCY_REPORT_SIZE + 1];
+	int			n;
+
+	if (sim_in) {
+		return xfer(set ? 0x21 : 0xA1, set ? HID_SET_REPORT : HID_GET_REPORT,
+					HID_REPORT_FEATURE << 8, KEYBOARD_INTERFACE, data, LATENCY_REPORT_SIZE);
+	}
+	if (hid_fd < 0) open_hid();
+	buf[0] = 0;
+	if (set) memcpy(buf + 1, data, LATENCY_REPORT_SIZE);
+	n = ioctl(hid_fd, set ? HIDIOCSFEATURE(sizeof(buf)) : HIDIOCGFEATURE(sizeof(buf)), buf);
+	if (n < 0) return (errno == EPIPE) ? XFER_STALL : XFER_ERROR;
+	if (!set) memcpy(data, buf + 1, LATENCY_REPORT_SIZE);
+	return n ? n - 1 : 0;
+}
+
+
+
+/*
+ *  Requests
+ */
+static void  check(int n, const char *what)
+{
+	if (n == XFER_STALL) {
+		fprintf(stderr, "vic20cfg: %s: rejected by the keyboard\n", what);
+		exit(1);
+	}
+	if (n < 0) {
+		fprintf(stderr, "vic20cfg: %s: transfer failed\n", what);
+		exit(1);
+	}
+}
+
+static void  get_status(uint8_t status[4])
+{
+	check(xfer(CONFIG_REQUEST_READ, CONFIG_STATUS, 0, 0, status, 4), "status");
+}
+
+static unsigned  get_param(unsigned param)
+{
+	uint8_t		buf[2];
+
+	check(xfer(CONFIG_REQUEST_READ, CONFIG_GET_PARAM, param, 0, buf, 2), param_names[param]);
+	return buf[0] | (buf[1] << 8);
+}
+
+static uint8_t  get_key(unsigned layer, unsigned row, unsigned col)
+{
+	uint8_t		code;
+
+	check(xfer(CONFIG_REQUEST_READ, CONFIG_GET_KEY, CONFIG_KEY(layer, row, col), 0, &code, 1), "key");
+	return code;
+}
+
+static void  write_request(uint8_t request, uint16_t value, uint16_t index, const char *what)
+{
+	check(xfer(CONFIG_REQUEST_WRITE, request, value, index, NULL, 0), what);
+}
+
+static unsigned long  number(const char *s, unsigned long max, const char *what)
+{
+	char			*end;
+	unsigned long	v;
+
+	v = strtoul(s, &end, 0);
+	if (end == s || *end || v > max) {
+		fprintf(stderr, "vic20cfg: bad %s: %s\n", what, s);
+		exit(2);
+	}
+	return v;
+}
+
+static int  param_index(const char *name)
+{
+	int			i;
+
+	for (i=0; i<CONFIG_NUM_PARAMS; i++) {
+		if (!strcmp(name, param_names[i])) return i;
+	}
+	fprintf(stderr, "vic20cfg: unknown parameter: %s\n", name);
+	exit(2);
+}
+
+static void  print_param(int param)
+{
+	unsigned	v = get_param(param);
+
+	if (param == CONFIG_PARAM_DEBOUNCE && v < NUM_DEBOUNCE) {
+		printf("%s %s\n", param_names[param], debounce_names[v]);
+	} else {
+		printf("%s %u\n", param_names[param], v);
+	}
+}
+
+static void  print_layer(unsigned layer)
+{
+	unsigned	row, col;
+
+	printf("layer %u\n", layer);
+	for (row=0; row<CONFIG_ROWS; row++) {
+		printf("  row %u ", row);
+		for (col=0; col<CONFIG_COLS; col++) printf(" %02x", get_key(layer, row, col));
+		printf("\n");
+	}
+}
+
+static void  save(void)
+{
+	uint8_t		status[4];
+	unsigned	waited = 0;
+
+	write_request(CONFIG_SAVE, 0, 0, "save");
+	do {
+		if (waited >= SAVE_TIMEOUT_MS) {
+			fprintf(stderr, "vic20cfg: save did not finish\n");
+			exit(1);
+		}
+		wait_ms(SAVE_POLL_MS);
+		waited += SAVE_POLL_MS;
+		get_status(status);
+	} while (status[0] & CONFIG_STATUS_SAVING);
+	printf("saved to slot %u, sequence %u\n", status[1], status[2] | (status[3] << 8));
+}
+
+static void  print_latency(void)
+{
+	uint8_t		buf[LATENCY_REPORT_SIZE];
+	unsigned	v[LATENCY_REPORT_SIZE / 2];
+	unsigned	i, count;
+
+	check(feature_xfer(0, buf), "latency");
+	for (i=0; i<LATENCY_REPORT_SIZE / 2; i++) v[i] = buf[2*i] | (buf[2*i + 1] << 8);
+	count = v[0];
+	printf("%u reports timed, %u dropped, %u over %lu ms\n", count, v[4], v[5], LATENCY_TIMEOUT_US / 1000);
+	if (count) {
+		printf("min %u us, avg %u us, max %u us\n", v[1], v[2], v[3]);
+		for (i=0; i<LATENCY_BUCKETS; i++) {
+			if (!v[7 + i]) continue;
+			if (i == LATENCY_BUCKETS - 1) printf("  >= %5u us  %u\n", i * v[6], v[7 + i]);
+			else printf("  %5u-%5u us  %u\n", i * v[6], (i + 1) * v[6] - 1, v[7 + i]);
+		}
+	}
+	i = 7 + LATENCY_BUCKETS;
+	printf("scan to start of frame: %u scans, %u late", v[i], v[i + 4]);
+	if (v[i]) printf(", slack min %u us, avg %u us, max %u us", v[i + 1], v[i + 2], v[i + 3]);
+	printf("\n");
+}
+
+// print the edges recorded so far; returns the number of bytes read
+static int  print_edges(uint64_t *base, uint32_t *last)
+{
+	uint8_t		buf[RECORD_READ_SIZE], *e;
+	uint32_t	us;
+	int			n, i;
+
+	n = xfer(CONFIG_REQUEST_READ, CONFIG_RECORD_READ, 0, 0, buf, RECORD_READ_SIZE);
+	check(n, "record");
+	for (i=0; i + RECORD_ENTRY_SIZE <= n; i += RECORD_ENTRY_SIZE) {
+		e = buf + i;
+		us = e[0] | (e[1] << 8) | (e[2] << 16) | ((uint32_t)e[3] << 24);
+		if (us < *last) *base += 1ULL << 32;	// the keyboard's clock wrapped
+		*last = us;
+		if (e[5] & RECORD_LOST) {
+			printf("# edges lost here, poll faster\n");
+			fprintf(stderr, "vic20cfg: record: edges lost\n");
+		}
+		printf("%.3f\t%s\t%u %u\n", RECORD_START_MS + (*base + us) / 1000.0,
+			   (e[5] & RECORD_DOWN) ? "down" : "up\t", e[4] >> 4, e[4] & 0x0f);
+	}
+	return n;
+}
+
+static void  record(unsigned seconds)
+{
+	uint64_t	base = 0;
+	uint32_t	last = 0;
+	unsigned	waited;
+
+	write_request(CONFIG_RECORD, 1, 0, "record");
+	printf("# recorded with vic20cfg record %u\n", seconds);
+	for (waited = 0; waited < seconds * 1000; waited += RECORD_POLL_MS) {
+		wait_ms(RECORD_POLL_MS);
+		while (print_edges(&base, &last) == RECORD_READ_SIZE) ;
+		fflush(stdout);
+	}
+	write_request(CONFIG_RECORD, 0, 0, "record");
+	while (print_edges(&base, &last) == RECORD_READ_SIZE) ;
+}
+
+static void  usage(void)
+{
+	fprintf(stderr,
+		"usage: vic20cfg [-d device | -s sim-command] command [argument ...]\n"
+		"       vic20cfg [-d device | -s sim-command] -b < commands\n"
+		"  status\n"
+		"  get [rate|debounce|press|release|phase]\n"
+		"  set <param> <value>\n"
+		"  key <layer> <row> <col> [code]\n"
+		"  dump [layer]\n"
+		"  save\n"
+		"  defaults\n"
+		"  latency [reset]\n"
+		"  record <seconds>\n");
+	exit(2);
+}
+
+// run one command; returns 0 if it was not understood
+static int  command(int argc, char **argv)
+{
+	const char	*cmd = argv[0];
+	uint8_t		status[4], report[LATENCY_REPORT_SIZE];
+	unsigned	layer, row, col, v;
+	int			param;
+
+	argc--;
+	argv++;
+	if (!strcmp(cmd, "status") && argc == 0) {
+		get_status(status);
+		if (status[0] & CONFIG_STATUS_STORED) {
+			printf("saved in slot %u, sequence %u\n", status[1], status[2] | (status[3] << 8));
+		} else {
+			printf("nothing saved, build-time settings at reset\n");
+		}
+		if (status[0] & CONFIG_STATUS_MODIFIED) printf("changed since loaded or saved\n");
+		if (status[0] & CONFIG_STATUS_SAVING) printf("save in progress\n");
+	} else if (!strcmp(cmd, "get") && argc <= 1) {
+		if (argc) print_param(param_index(argv[0]));
+		else for (param=0; param<CONFIG_NUM_PARAMS; param++) print_param(param);
+	} else if (!strcmp(cmd, "set") && argc == 2) {
+		param = param_index(argv[0]);
+		v = NUM_DEBOUNCE;
+		if (param == CONFIG_PARAM_DEBOUNCE) {
+			for (v=0; v<NUM_DEBOUNCE && strcmp(argv[1], debounce_names[v]); v++) ;
+		}
+		if (v == NUM_DEBOUNCE) v = number(argv[1], 0xffff, param_names[param]);
+		write_request(CONFIG_SET_PARAM, param, v, param_names[param]);
+	} else if (!strcmp(cmd, "key") && (argc == 3 || argc == 4)) {
+		layer = number(argv[0], CONFIG_LAYERS - 1, "layer");
+		row = number(argv[1], CONFIG_ROWS - 1, "row");
+		col = number(argv[2], CONFIG_COLS - 1, "column");
+		if (argc == 4) {
+			v = number(argv[3], 0xff, "code");
+			write_request(CONFIG_SET_KEY, CONFIG_KEY(layer, row, col), v, "key");
+		} else {
+			printf("0x%02x\n", get_key(layer, row, col));
+		}
+	} else if (!strcmp(cmd, "dump") && argc <= 1) {
+		if (argc) print_layer(number(argv[0], CONFIG_LAYERS - 1, "layer"));
+		else for (layer=0; layer<CONFIG_LAYERS; layer++) print_layer(layer);
+	} else if (!strcmp(cmd, "save") && argc == 0) {
+		save();
+	} else if (!strcmp(cmd, "defaults") && argc == 0) {
+		write_request(CONFIG_DEFAULTS, 0, 0, "defaults");
+	} else if (!strcmp(cmd, "latency") && argc == 0) {
+		print_latency();
+	} else if (!strcmp(cmd, "latency") && argc == 1 && !strcmp(argv[0], "reset")) {
+		memset(report, 0, sizeof(report));
+		check(feature_xfer(1, report), "latency reset");
+	} else if (!strcmp(cmd, "record") && argc == 1) {
+		record(number(argv[0], 3600, "seconds"));
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+// run commands from standard input, one per line, on one connection
+static void  batch(void)
+{
+	char		line[256], *words[8];
+	int			n;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		if (strchr(line, '#')) *strchr(line, '#') = 0;
+		n = 0;
+		words[n] = strtok(line, " \t\r\n");
+		while (words[n] && n < 7) words[++n] = strtok(NULL, " \t\r\n");
+		if (n == 0) continue;
+		if (!command(n, words)) {
+			fprintf(stderr, "vic20cfg: bad command: %s\n", words[0]);
+			exit(2);
+		}
+		fflush(stdout);
+	}
+}
+
+int  main(int argc, char **argv)
+{
+	const char	*device = NULL, *sim = NULL;
+	int			i, batched = 0;
+
+	for (i=1; i<argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-d") && i + 1 < argc) device = argv[++i];
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc) sim = argv[++i];
+		else if (!strcmp(argv[i], "-b")) batched = 1;
+		else usage();
+	}
+	if (batched ? (i != argc) : (i == argc)) usage();
+
+	if (sim) open_sim(sim);
+	else open_usb(device);
+	if (batched) batch();
+	else if (!command(argc - i, argv + i)) usage();
+	close_sim();
+	return 0;
+}
@@ -26,6 +26,9 @@
 
 #define USB_SERIAL_PRIVATE_INCLUDE
 #include "usb_keyboard.h"
+#include "config.h"
+#include "latency.h"
+#include "timer.h"
 
 /**************************************************************************
  *
@@ -65,7 +68,7 @@
 
 #define KEYBOARD_INTERFACE	0
 #define KEYBOARD_ENDPOINT	3
-#define KEYBOARD_SIZE		8
+#define KEYBOARD_SIZE		16			// N-key rollover report; the boot report is 8
 #define KEYBOARD_BUFFER		EP_DOUBLE_BUFFER
 
 static const uint8_t PROGMEM endpoint_config_table[] = {
@@ -106,7 +109,12 @@ static uint8_t PROGMEM device_descriptor[] = {
 	1					// bNumConfigurations
 };
 
-// Keyboard Protocol 1, HID 1.11 spec, Appendix B, page 59-60
+// Keyboard report descriptor for the report protocol: a modifier byte
+// followed by one bit for each usage 0-119 (N-key rollover).  Hosts that
+// select the boot protocol (HID 1.11 spec, Appendix B, page 59-60) ignore
+// this and get the 8-byte boot report instead.  The feature report holds
+// the latency statistics of latency.h; there is one report of each type,
+// so none of them needs a report ID.
 static uint8_t PROGMEM keyboard_hid_report_desc[] = {
         0x05, 0x01,          // Usage Page (Generic Desktop),
         0x09, 0x06,          // Usage (Keyboard),
@@ -119,9 +127,6 @@ static uint8_t PROGMEM keyboard_hid_report_desc[] = {
         0x15, 0x00,          //   Logical Minimum (0),
         0x25, 0x01,          //   Logical Maximum (1),
         0x81, 0x02,          //   Input (Data, Variable, Absolute), ;Modifier byte
-        0x95, 0x01,          //   Report Count (1),
-        0x75, 0x08,          //   Report Size (8),
-        0x81, 0x03,          //   Input (Constant),                 ;Reserved byte
         0x95, 0x05,          //   Report Count (5),
         0x75, 0x01,          //   Report Size (1),
         0x05, 0x08,          //   Usage Page (LEDs),
@@ -131,14 +136,21 @@ static uint8_t PROGMEM keyboard_hid_report_desc[] = {
         0x95, 0x01,          //   Report Count (1),
         0x75, 0x03,          //   Report Size (3),
         0x91, 0x03,          //   Output (Constant),                 ;LED report padding
-        0x95, 0x06,          //   Report Count (6),
-        0x75, 0x08,          //   Report Size (8),
+        0x95, KEYBOARD_BITMAP_SIZE*8, //   Report Count (120),
+        0x75, 0x01,          //   Report Size (1),
         0x15, 0x00,          //   Logical Minimum (0),
-        0x25, 0x68,          //   Logical Maximum(104),
+        0x25, 0x01,          //   Logical Maximum (1),
         0x05, 0x07,          //   Usage Page (Key Codes),
         0x19, 0x00,          //   Usage Minimum (0),
-        0x29, 0x68,          //   Usage Maximum (104),
-        0x81, 0x00,          //   Input (Data, Array),
+        0x29, KEYBOARD_BITMAP_SIZE*8-1, //   Usage Maximum (119),
+        0x81, 0x02,          //   Input (Data, Variable, Absolute), ;Key bitmap
+        0x06, 0x00, 0xFF,    //   Usage Page (Vendor Defined 0xFF00),
+        0x09, 0x01,          //   Usage (1),
+        0x15, 0x00,          //   Logical Minimum (0),
+        0x26, 0xFF, 0x00,    //   Logical Maximum (255),
+        0x75, 0x08,          //   Report Size (8),
+        0x95, LATENCY_REPORT_SIZE, //   Report Count (LATENCY_REPORT_SIZE),
+        0xB1, 0x02,          //   Feature (Data, Variable, Absolute), ;Latency statistics
         0xc0                 // End Collection
 };
 
@@ -153,7 +165,7 @@ static uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	1,					// bNumInterfaces
 	1,					// bConfigurationValue
 	0,					// iConfiguration
-	0xC0,					// bmAttributes
+	0xA0,					// bmAttributes (bus powered, remote wakeup)
 	50,					// bMaxPower
 	// interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
 	9,					// bLength
@@ -189,7 +201,7 @@ static uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 struct usb_string_descriptor_struct {
 	uint8_t bLength;
 	uint8_t bDescriptorType;
-	int16_t wString[];
+	wchar_t wString[];
 };
 static struct usb_string_descriptor_struct PROGMEM string0 = {
 	4,
@@ -207,23 +219,28 @@ static struct usb_string_descriptor_struct PROGMEM string2 = {
 	STR_PRODUCT
 };
 
-// This table defines which descriptor data is sent for each specific
-// request from the host (in wValue and wIndex).
-static struct descriptor_list_struct {
-	uint16_t	wValue;
-	uint16_t	wIndex;
+// This table holds every descriptor the host can ask for.  It is
+// indexed directly by usb_descriptor_index(), so finding a descriptor
+// takes the same time whichever one is requested.
+struct descriptor_struct {
 	const uint8_t	*addr;
 	uint8_t		length;
-} PROGMEM descriptor_list[] = {
-	{0x0100, 0x0000, device_descriptor, sizeof(device_descriptor)},
-	{0x0200, 0x0000, config1_descriptor, sizeof(config1_descriptor)},
-	{0x2200, KEYBOARD_INTERFACE, keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc)},
-	{0x2100, KEYBOARD_INTERFACE, config1_descriptor+KEYBOARD_HID_DESC_OFFSET, 9},
-	{0x0300, 0x0000, (const uint8_t *)&string0, 4},
-	{0x0301, 0x0409, (const uint8_t *)&string1, sizeof(STR_MANUFACTURER)},
-	{0x0302, 0x0409, (const uint8_t *)&string2, sizeof(STR_PRODUCT)}
 };
-#define NUM_DESC_LIST (sizeof(descriptor_list)/sizeof(struct descriptor_list_struct))
+#define DESC_DEVICE		0
+#define DESC_CONFIG		1
+#define DESC_HID		2
+#define DESC_REPORT		3
+#define DESC_STRING		4	// string n is at DESC_STRING+n
+#define NUM_STRINGS		3
+static struct descriptor_struct PROGMEM descriptor_table[DESC_STRING+NUM_STRINGS] = {
+	[DESC_DEVICE] = {device_descriptor, sizeof(device_descriptor)},
+	[DESC_CONFIG] = {config1_descriptor, sizeof(config1_descriptor)},
+	[DESC_HID] = {config1_descriptor+KEYBOARD_HID_DESC_OFFSET, 9},
+	[DESC_REPORT] = {keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc)},
+	[DESC_STRING+0] = {(const uint8_t *)&string0, 4},
+	[DESC_STRING+1] = {(const uint8_t *)&string1, sizeof(STR_MANUFACTURER)},
+	[DESC_STRING+2] = {(const uint8_t *)&string2, sizeof(STR_PRODUCT)}
+};
 
 
 /**************************************************************************
@@ -235,6 +252,30 @@ static struct descriptor_list_struct {
 // zero when we are not configured, non-zero when enumerated
 static volatile uint8_t usb_configuration=0;
 
+// non-zero while the host has suspended the bus; the USB clock is
+// frozen and the PLL stopped meanwhile
+static volatile uint8_t usb_suspend=0;
+
+// set while the host allows remote wakeup (SET_FEATURE DEVICE_REMOTE_WAKEUP)
+static uint8_t usb_remote_wakeup_enabled=0;
+
+// the control transfer in progress on endpoint 0.  Each endpoint
+// interrupt moves it on by at most one packet and returns, so the
+// interrupt never waits for the host.
+#define EP0_IDLE		0
+#define EP0_DATA_IN		1	// sending the data stage, a packet per TXINI
+#define EP0_STATUS_OUT		2	// all sent, waiting for the status OUT
+#define EP0_DATA_OUT		3	// receiving the data stage, a packet per RXOUTI
+#define EP0_SET_ADDRESS		4	// status IN queued, address applies once sent
+static uint8_t ep0_state=EP0_IDLE;
+static const uint8_t *ep0_data;		// next byte of an IN data stage
+static uint8_t ep0_data_pgm;		// ep0_data points into program memory
+static uint16_t ep0_len;		// data stage bytes still to send or receive
+static uint8_t ep0_zlp;			// data stage is shorter than the host asked for
+static uint8_t ep0_request;		// what to do with OUT data, or the new address
+static uint8_t ep0_buf[LATENCY_REPORT_SIZE];	// IN data built in RAM: the largest
+						// report, also used for config.h
+
 // which modifier keys are currently pressed
 // 1=left ctrl,    2=left shift,   4=left alt,    8=left gui
 // 16=right ctrl, 32=right shift, 64=right alt, 128=right gui
@@ -243,9 +284,13 @@ uint8_t keyboard_modifier_keys=0;
 // which keys are currently pressed, up to 6 keys may be down at once
 uint8_t keyboard_keys[6]={0,0,0,0,0,0};
 
-// protocol setting from the host.  We use exactly the same report
-// either way, so this variable only stores the setting since we
-// are required to be able to report which setting is in use.
+// which keys are currently pressed, one bit per usage (bit n of byte
+// n/8 for usage n), any number of keys may be down at once
+uint8_t keyboard_bitmap[KEYBOARD_BITMAP_SIZE];
+
+// protocol setting from the host.  0 = boot protocol, where the
+// 8-byte report with keyboard_keys is sent; 1 = report protocol
+// (the default after reset), where the bitmap report is sent.
 static uint8_t keyboard_protocol=1;
 
 // the idle configuration, how often we send the report to the
@@ -255,6 +300,43 @@ static uint8_t keyboard_idle_config=125;
 // count until idle timeout
 static uint8_t keyboard_idle_count=0;
 
+// the current key state as a complete report, double buffered.  The
+// main loop builds a report in the buffer not in use and then bumps
+// keyboard_snapshot_seq, a single byte store, so an interrupt always
+// finds a whole report in keyboard_snapshot[keyboard_snapshot_seq & 1]
+// and neither side has to disable interrupts while it is copied.
+static uint8_t keyboard_snapshot[2][KEYBOARD_SIZE];
+static uint8_t keyboard_snapshot_protocol[2];	// protocol it was built for
+static uint32_t keyboard_snapshot_stamp[2];	// edge time, for latency.h
+static uint8_t keyboard_snapshot_stamped[2];	// 1 if it has one
+static volatile uint8_t keyboard_snapshot_seq=0;
+
+// when the queue is full the snapshot goes to the host once the queue
+// has drained: the main loop sets keyboard_snapshot_pending with
+// interrupts off, and the start of frame interrupt clears it once it has
+// sent the snapshot
+static volatile uint8_t keyboard_snapshot_pending=0;
+
+// reports waiting for the endpoint, oldest at keyboard_queue_head.  The
+// start of frame interrupt moves them into the endpoint's two banks.
+// The slot before the head keeps the last report sent, for the idle
+// re-send, so the queue is full when the tail reaches it.  Only the main
+// loop writes the slot at the tail before moving the tail past it, and
+// only the interrupt moves the head.
+#define KEYBOARD_QUEUE_SIZE	8			// must be a power of 2
+static uint8_t keyboard_queue[KEYBOARD_QUEUE_SIZE][KEYBOARD_SIZE];
+static uint8_t keyboard_queue_protocol[KEYBOARD_QUEUE_SIZE];
+static volatile uint8_t keyboard_queue_head=0;
+static volatile uint8_t keyboard_queue_tail=0;
+
+// edge time of each queued report, for latency.h, where
+// keyboard_queue_stamped is 1
+static uint32_t keyboard_queue_stamp[KEYBOARD_QUEUE_SIZE];
+static uint8_t keyboard_queue_stamped[KEYBOARD_QUEUE_SIZE];
+
+// number of times usb_keyboard_send() found the queue full
+volatile uint16_t keyboard_queue_overflows=0;
+
 // 1=num lock, 2=caps lock, 4=scroll lock, 8=compose, 16=kana
 volatile uint8_t keyboard_leds=0;
 
@@ -276,7 +358,8 @@ void usb_init(void)
         USB_CONFIG();				// start USB clock
         UDCON = 0;				// enable attach resistor
 	usb_configuration = 0;
-        UDIEN = (1<<EORSTE)|(1<<SOFE);
+	usb_suspend = 0;
+        UDIEN = (1<<EORSTE)|(1<<SOFE)|(1<<SUSPE);
 	sei();
 }
 
@@ -287,6 +370,40 @@ uint8_t usb_configured(void)
 	return usb_configuration;
 }
 
+// return non-zero while the host has suspended the bus
+uint8_t usb_suspended(void)
+{
+	return usb_suspend;
+}
+
+// restart the PLL and the USB clock after a suspend
+static void usb_resume_clock(void)
+{
+	PLL_CONFIG();
+	while (!(PLLCSR & (1<<PLOCK))) ;
+	USB_CONFIG();
+}
+
+// ask the host to resume a suspended bus.  Returns 0 if resume
+// signalling was started, -1 if the bus is not suspended or the host
+// has not allowed remote wakeup.  Queued reports go out once the host
+// has resumed the bus and frames start again.
+int8_t usb_remote_wakeup(void)
+{
+	uint8_t intr_state;
+
+	if (!usb_suspend || !usb_remote_wakeup_enabled) return -1;
+	intr_state = SREG;
+	cli();
+	usb_resume_clock();
+	UDINT = ~((1<<SUSPI)|(1<<WAKEUPI));
+	UDIEN = (UDIEN & ~(1<<WAKEUPE)) | (1<<SUSPE);
+	UDCON |= (1<<RMWKUP);
+	usb_suspend = 0;
+	SREG = intr_state;
+	return 0;
+}
+
 
 // perform a single keystroke
 int8_t usb_keyboard_press(uint8_t key, uint8_t modifier)
@@ -295,47 +412,158 @@ int8_t usb_keyboard_press(uint8_t key, uint8_t modifier)
 
 	keyboard_modifier_keys = modifier;
 	keyboard_keys[0] = key;
+	if (key < KEYBOARD_BITMAP_SIZE*8) keyboard_bitmap[key >> 3] |= (1 << (key & 7));
 	r = usb_keyboard_send();
 	if (r) return r;
 	keyboard_modifier_keys = 0;
 	keyboard_keys[0] = 0;
+	if (key < KEYBOARD_BITMAP_SIZE*8) keyboard_bitmap[key >> 3] &= ~(1 << (key & 7));
 	return usb_keyboard_send();
 }
 
-// send the contents of keyboard_keys and keyboard_modifier_keys
-int8_t usb_keyboard_send(void)
+// length of the report for the current protocol
+static inline uint8_t usb_keyboard_report_len(void)
+{
+	return keyboard_protocol ? KEYBOARD_SIZE : 8;
+}
+
+// format the current key state as a report for a protocol
+static void usb_keyboard_fill_report(uint8_t *buf, uint8_t protocol)
 {
-	uint8_t i, intr_state, timeout;
+	uint8_t i;
+
+	*buf++ = keyboard_modifier_keys;
+	if (protocol) {
+		for (i=0; i<KEYBOARD_BITMAP_SIZE; i++) {
+			*buf++ = keyboard_bitmap[i];
+		}
+	} else {
+		*buf++ = 0;
+		for (i=0; i<6; i++) {
+			*buf++ = keyboard_keys[i];
+		}
+	}
+}
+
+// copy a report built for one protocol into buf in the format of the
+// current one, so keys pressed before the host chose it still reach it.
+// A boot report in rollover becomes an empty bitmap; a bitmap of more
+// than six keys becomes a boot report in rollover.
+static void usb_keyboard_copy_report(uint8_t *buf, const uint8_t *r, uint8_t protocol)
+{
+	uint8_t j, k, n, bits, over;
+
+	buf[0] = r[0];
+	if (protocol == keyboard_protocol) {
+		for (j=1; j<KEYBOARD_SIZE; j++) buf[j] = r[j];
+		return;
+	}
+	for (j=1; j<KEYBOARD_SIZE; j++) buf[j] = 0;
+	if (keyboard_protocol) {
+		for (j=2; j<8; j++) {
+			k = r[j];
+			if (k > KEY_errorUndefined && k < KEYBOARD_BITMAP_SIZE*8) {
+				buf[1 + (k >> 3)] |= (1 << (k & 7));
+			}
+		}
+	} else {
+		n = 2;
+		over = 0;
+		for (j=0; j<KEYBOARD_BITMAP_SIZE; j++) {
+			bits = r[1 + j];
+			for (k=j*8; bits; k++, bits >>= 1) {
+				if (!(bits & 1)) continue;
+				if (n < 8) buf[n++] = k;
+				else over = 1;
+			}
+		}
+		if (over) {
+			for (n=2; n<8; n++) buf[n] = KEY_errorRollOver;
+		}
+	}
+}
+
+// write a report built for a protocol into the selected endpoint
+static void usb_keyboard_write_report(const uint8_t *r, uint8_t protocol)
+{
+	uint8_t i, len;
+	uint8_t buf[KEYBOARD_SIZE];
+
+	if (protocol != keyboard_protocol) {
+		usb_keyboard_copy_report(buf, r, protocol);
+		r = buf;
+	}
+	len = usb_keyboard_report_len();
+	for (i=0; i<len; i++) {
+		UEDATX = *r++;
+	}
+}
+
+// publish the contents of keyboard_keys (boot protocol) or
+// keyboard_bitmap (report protocol) and keyboard_modifier_keys as the
+// new snapshot, with its edge time if stamped, and queue a copy; the
+// start of frame interrupt passes it to the endpoint.
+// If the queue is full the snapshot itself goes out once the queue has
+// drained, so the host still ends up with the current state; a snapshot
+// replacing one not yet sent keeps the older edge time.
+// Reports are queued before the host has configured the device too,
+// and go out once it has; they carry no edge time, as their wait for
+// enumeration says nothing about the keyboard's latency.
+static int8_t usb_keyboard_queue(uint8_t stamped, uint32_t stamp)
+{
+	uint8_t intr_state, seq, s, i, n, next, waiting, full;
+
+	seq = keyboard_snapshot_seq;
+	s = (seq + 1) & 1;
+	keyboard_snapshot_protocol[s] = keyboard_protocol;
+	usb_keyboard_fill_report(keyboard_snapshot[s], keyboard_snapshot_protocol[s]);
+	keyboard_snapshot_stamped[s] = stamped && usb_configuration;
+	keyboard_snapshot_stamp[s] = stamp;
 
-	if (!usb_configuration) return -1;
 	intr_state = SREG;
 	cli();
-	UENUM = KEYBOARD_ENDPOINT;
-	timeout = UDFNUML + 50;
-	while (1) {
-		// are we ready to transmit?
-		if (UEINTX & (1<<RWAL)) break;
-		SREG = intr_state;
-		// has the USB gone offline?
-		if (!usb_configuration) return -1;
-		// have we waited too long?
-		if (UDFNUML == timeout) return -1;
-		// get ready to try checking again
-		intr_state = SREG;
-		cli();
-		UENUM = KEYBOARD_ENDPOINT;
+	waiting = keyboard_snapshot_pending;
+	if (waiting && keyboard_snapshot_stamped[seq & 1]) {
+		keyboard_snapshot_stamp[s] = keyboard_snapshot_stamp[seq & 1];
+		keyboard_snapshot_stamped[s] = 1;
 	}
-	UEDATX = keyboard_modifier_keys;
-	UEDATX = 0;
-	for (i=0; i<6; i++) {
-		UEDATX = keyboard_keys[i];
-	}
-	UEINTX = 0x3A;
-	keyboard_idle_count = 0;
+	keyboard_snapshot_seq = seq + 1;
+	n = keyboard_queue_tail;
+	next = (n + 1) & (KEYBOARD_QUEUE_SIZE - 1);
+	full = waiting || next == keyboard_queue_head;
+	if (full) keyboard_snapshot_pending = 1;
+	if (waiting) latency_drop();	// with interrupts off, see latency.c
 	SREG = intr_state;
+
+	if (full) {
+		if (keyboard_queue_overflows != 0xFFFF) keyboard_queue_overflows++;
+		return -1;
+	}
+	for (i=0; i<KEYBOARD_SIZE; i++) keyboard_queue[n][i] = keyboard_snapshot[s][i];
+	keyboard_queue_protocol[n] = keyboard_snapshot_protocol[s];
+	keyboard_queue_stamp[n] = keyboard_snapshot_stamp[s];
+	keyboard_queue_stamped[n] = keyboard_snapshot_stamped[s];
+	keyboard_queue_tail = next;
 	return 0;
 }
 
+// queue the current key state for the host.  This never waits for the
+// host; if the queue was full the overflow is counted in
+// keyboard_queue_overflows and -1 is returned, but the host still gets
+// the current state.
+int8_t usb_keyboard_send(void)
+{
+	return usb_keyboard_queue(0, 0);
+}
+
+// the same, for a report caused by a key edge found at timer_micros()
+// == stamp; the time until the report reaches the endpoint goes into the
+// latency statistics
+int8_t usb_keyboard_send_stamped(uint32_t stamp)
+{
+	return usb_keyboard_queue(1, stamp);
+}
+
 /**************************************************************************
  *
  *  Private Functions - not intended for general user consumption....
@@ -345,14 +573,23 @@ int8_t usb_keyboard_send(void)
 
 
 // USB Device Interrupt - handle all device-level events
-// the transmit buffer flushing is triggered by the start of frame
+// the transmit buffer flushing is triggered by the start of frame:
+// queued reports go out first, as many as the endpoint has free banks
+// for, and the idle re-send only runs once the queue is empty.
+// Suspend freezes the USB clock and stops the PLL; bus activity sets
+// WAKEUPI even with the clock frozen, and restarts them.
 //
 ISR(USB_GEN_vect)
 {
-	uint8_t intbits, t, i;
+	uint8_t intbits, n, i, s;
 	static uint8_t div4=0;
 
         intbits = UDINT;
+	if ((intbits & (1<<WAKEUPI)) && usb_suspend) {
+		usb_resume_clock();		// WAKEUPI only clears with the clock running
+		UDIEN = (UDIEN & ~(1<<WAKEUPE)) | (1<<SUSPE);
+		usb_suspend = 0;
+	}
         UDINT = 0;
         if (intbits & (1<<EORSTI)) {
 		UENUM = 0;
@@ -361,19 +598,56 @@ ISR(USB_GEN_vect)
 		UECFG1X = EP_SIZE(ENDPOINT0_SIZE) | EP_SINGLE_BUFFER;
 		UEIENX = (1<<RXSTPE);
 		usb_configuration = 0;
+		usb_remote_wakeup_enabled = 0;
+		ep0_state = EP0_IDLE;
+		keyboard_protocol = 1;
         }
+	if ((intbits & ((1<<SUSPI)|(1<<WAKEUPI))) == (1<<SUSPI) && !usb_suspend
+	  && (UDIEN & (1<<SUSPE))) {
+		UDIEN = (UDIEN & ~(1<<SUSPE)) | (1<<WAKEUPE);
+		USB_FREEZE();
+		PLLCSR = 0;
+		usb_suspend = 1;
+		return;
+	}
+	if (intbits & (1<<SOFI)) {
+		latency_slack(timer_sof());
+	}
 	if ((intbits & (1<<SOFI)) && usb_configuration) {
-		if (keyboard_idle_config && (++div4 & 3) == 0) {
-			UENUM = KEYBOARD_ENDPOINT;
+		UENUM = KEYBOARD_ENDPOINT;
+		n = keyboard_queue_head;
+		while (n != keyboard_queue_tail && (UEINTX & (1<<RWAL))) {
+			usb_keyboard_write_report(keyboard_queue[n], keyboard_queue_protocol[n]);
+			UEINTX = 0x3A;
+			if (keyboard_queue_stamped[n]) {
+				latency_record(keyboard_queue_stamp[n]);
+			}
+			n = (n + 1) & (KEYBOARD_QUEUE_SIZE - 1);
+			keyboard_idle_count = 0;
+		}
+		keyboard_queue_head = n;
+		// the queue overflowed: once it has drained send the snapshot,
+		// and keep a copy in the slot the idle re-send repeats
+		if (n == keyboard_queue_tail && keyboard_snapshot_pending
+		  && (UEINTX & (1<<RWAL))) {
+			s = keyboard_snapshot_seq & 1;
+			usb_keyboard_write_report(keyboard_snapshot[s], keyboard_snapshot_protocol[s]);
+			UEINTX = 0x3A;
+			if (keyboard_snapshot_stamped[s]) {
+				latency_record(keyboard_snapshot_stamp[s]);
+			}
+			n = (n - 1) & (KEYBOARD_QUEUE_SIZE - 1);
+			for (i=0; i<KEYBOARD_SIZE; i++) keyboard_queue[n][i] = keyboard_snapshot[s][i];
+			keyboard_queue_protocol[n] = keyboard_snapshot_protocol[s];
+			keyboard_snapshot_pending = 0;
+			keyboard_idle_count = 0;
+		} else if (keyboard_idle_config && (++div4 & 3) == 0 && n == keyboard_queue_tail) {
 			if (UEINTX & (1<<RWAL)) {
 				keyboard_idle_count++;
 				if (keyboard_idle_count == keyboard_idle_config) {
 					keyboard_idle_count = 0;
-					UEDATX = keyboard_modifier_keys;
-					UEDATX = 0;
-					for (i=0; i<6; i++) {
-						UEDATX = keyboard_keys[i];
-					}
+					n = (n - 1) & (KEYBOARD_QUEUE_SIZE - 1);
+					usb_keyboard_write_report(keyboard_queue[n], keyboard_queue_protocol[n]);
 					UEINTX = 0x3A;
 				}
 			}
@@ -383,206 +657,286 @@ ISR(USB_GEN_vect)
 
 
 
-// Misc functions to wait for ready and send/receive packets
-static inline void usb_wait_in_ready(void)
-{
-	while (!(UEINTX & (1<<TXINI))) ;
-}
+// Misc functions to send/receive packets
 static inline void usb_send_in(void)
 {
 	UEINTX = ~(1<<TXINI);
 }
-static inline void usb_wait_receive_out(void)
-{
-	while (!(UEINTX & (1<<RXOUTI))) ;
-}
 static inline void usb_ack_out(void)
 {
 	UEINTX = ~(1<<RXOUTI);
 }
 
+// find the descriptor for a GET_DESCRIPTOR request; returns its index
+// in descriptor_table, or 0xFF if there is no such descriptor
+static uint8_t usb_descriptor_index(uint16_t wValue, uint16_t wIndex)
+{
+	uint8_t n = LSB(wValue);
+
+	switch (MSB(wValue)) {
+	  case 0x01:
+		if (n == 0 && wIndex == 0) return DESC_DEVICE;
+		break;
+	  case 0x02:
+		if (n == 0 && wIndex == 0) return DESC_CONFIG;
+		break;
+	  case 0x03:
+		if (n == 0 && wIndex == 0) return DESC_STRING;
+		if (n < NUM_STRINGS && wIndex == 0x0409) return DESC_STRING + n;
+		break;
+	  case 0x21:
+		if (n == 0 && wIndex == KEYBOARD_INTERFACE) return DESC_HID;
+		break;
+	  case 0x22:
+		if (n == 0 && wIndex == KEYBOARD_INTERFACE) return DESC_REPORT;
+		break;
+	}
+	return 0xFF;
+}
+
+// send the next packet of the data stage of a control read, if the
+// bank is free; after the last one, wait for the status OUT
+static void usb_ep0_in(void)
+{
+	uint8_t i, n;
 
+	if (!(UEINTX & (1<<TXINI))) return;
+	n = ep0_len < ENDPOINT0_SIZE ? ep0_len : ENDPOINT0_SIZE;
+	for (i = n; i; i--) {
+		UEDATX = ep0_data_pgm ? pgm_read_byte(ep0_data) : *ep0_data;
+		ep0_data++;
+	}
+	ep0_len -= n;
+	usb_send_in();
+	// a full last packet needs a zero length one after it if the
+	// host asked for more
+	if (ep0_len == 0 && (n < ENDPOINT0_SIZE || !ep0_zlp)) {
+		ep0_state = EP0_STATUS_OUT;
+		UEIENX = (1<<RXSTPE)|(1<<RXOUTE);
+	}
+}
 
-// USB Endpoint Interrupt - endpoint 0 is handled here.  The
-// other endpoints are manipulated by the user-callable
-// functions, and the start-of-frame interrupt.
-//
-ISR(USB_COM_vect)
+// start the data stage of a control read of len bytes, from program
+// memory if pgm is set; the host gets no more than wLength of them
+static void usb_ep0_send(const uint8_t *data, uint8_t len, uint8_t pgm, uint16_t wLength)
+{
+	if (len > wLength) len = wLength;
+	ep0_data = data;
+	ep0_data_pgm = pgm;
+	ep0_len = len;
+	ep0_zlp = (len < wLength);
+	ep0_state = EP0_DATA_IN;
+	UEIENX = (1<<RXSTPE)|(1<<RXOUTE)|(1<<TXINE);
+	usb_ep0_in();
+}
+
+// start the data stage of a control write; each packet is handled by
+// usb_ep0_out() and the status IN is sent after the last one
+static void usb_ep0_receive(uint8_t request, uint16_t wLength)
+{
+	ep0_request = request;
+	ep0_len = wLength;
+	ep0_state = EP0_DATA_OUT;
+	UEIENX = (1<<RXSTPE)|(1<<RXOUTE);
+}
+
+// take one packet of the data stage of a control write
+static void usb_ep0_out(void)
+{
+	uint8_t n;
+
+	n = ep0_len < ENDPOINT0_SIZE ? ep0_len : ENDPOINT0_SIZE;
+	if (ep0_request == HID_REPORT_OUTPUT && n) {
+		keyboard_leds = UEDATX;
+		ep0_request = 0;	// only the first byte is the LEDs
+	}
+	usb_ack_out();
+	ep0_len -= n;
+	if (ep0_len) return;
+	// any write of the feature report clears the statistics
+	if (ep0_request == HID_REPORT_FEATURE) latency_reset();
+	usb_send_in();
+	ep0_state = EP0_IDLE;
+	UEIENX = (1<<RXSTPE);
+}
+
+// handle a SETUP packet: answer it at once, or start a data stage
+// for usb_ep0_in() or usb_ep0_out() to carry on with
+static void usb_ep0_setup(void)
 {
-        uint8_t intbits;
-	const uint8_t *list;
         const uint8_t *cfg;
-	uint8_t i, n, len, en;
+	uint8_t i, en;
 	uint8_t bmRequestType;
 	uint8_t bRequest;
 	uint16_t wValue;
 	uint16_t wIndex;
 	uint16_t wLength;
-	uint16_t desc_val;
-	const uint8_t *desc_addr;
-	uint8_t	desc_length;
-
-        UENUM = 0;
-	intbits = UEINTX;
-        if (intbits & (1<<RXSTPI)) {
-                bmRequestType = UEDATX;
-                bRequest = UEDATX;
-                wValue = UEDATX;
-                wValue |= (UEDATX << 8);
-                wIndex = UEDATX;
-                wIndex |= (UEDATX << 8);
-                wLength = UEDATX;
-                wLength |= (UEDATX << 8);
-                UEINTX = ~((1<<RXSTPI) | (1<<RXOUTI) | (1<<TXINI));
-                if (bRequest == GET_DESCRIPTOR) {
-			list = (const uint8_t *)descriptor_list;
-			for (i=0; ; i++) {
-				if (i >= NUM_DESC_LIST) {
-					UECONX = (1<<STALLRQ)|(1<<EPEN);  //stall
-					return;
-				}
-				desc_val = pgm_read_word(list);
-				if (desc_val != wValue) {
-					list += sizeof(struct descriptor_list_struct);
-					continue;
-				}
-				list += 2;
-				desc_val = pgm_read_word(list);
-				if (desc_val != wIndex) {
-					list += sizeof(struct descriptor_list_struct)-2;
-					continue;
-				}
-				list += 2;
-				desc_addr = (const uint8_t *)pgm_read_word(list);
-				list += 2;
-				desc_length = pgm_read_byte(list);
-				break;
-			}
-			len = (wLength < 256) ? wLength : 255;
-			if (len > desc_length) len = desc_length;
-			do {
-				// wait for host ready for IN packet
-				do {
-					i = UEINTX;
-				} while (!(i & ((1<<TXINI)|(1<<RXOUTI))));
-				if (i & (1<<RXOUTI)) return;	// abort
-				// send IN packet
-				n = len < ENDPOINT0_SIZE ? len : ENDPOINT0_SIZE;
-				for (i = n; i; i--) {
-					UEDATX = pgm_read_byte(desc_addr++);
-				}
-				len -= n;
-				usb_send_in();
-			} while (len || n == ENDPOINT0_SIZE);
-			return;
-                }
-		if (bRequest == SET_ADDRESS) {
-			usb_send_in();
-			usb_wait_in_ready();
-			UDADDR = wValue | (1<<ADDEN);
+	struct descriptor_struct desc;
+	int8_t cfglen;
+	uint8_t s;
+
+        bmRequestType = UEDATX;
+        bRequest = UEDATX;
+        wValue = UEDATX;
+        wValue |= (UEDATX << 8);
+        wIndex = UEDATX;
+        wIndex |= (UEDATX << 8);
+        wLength = UEDATX;
+        wLength |= (UEDATX << 8);
+        UEINTX = ~((1<<RXSTPI) | (1<<RXOUTI) | (1<<TXINI));
+	// a SETUP ends any transfer still in progress
+	ep0_state = EP0_IDLE;
+	UEIENX = (1<<RXSTPE);
+	// Vendor requests (config.h) go first: some of the standard
+	// requests below are matched on bRequest alone.
+	if (bmRequestType == CONFIG_REQUEST_READ) {
+		cfglen = config_get(bRequest, wValue, wIndex, ep0_buf);
+		if (cfglen >= 0) {
+			usb_ep0_send(ep0_buf, cfglen, 0, wLength);
 			return;
 		}
-		if (bRequest == SET_CONFIGURATION && bmRequestType == 0) {
-			usb_configuration = wValue;
+		UECONX = (1<<STALLRQ) | (1<<EPEN);	// stall
+		return;
+	}
+	if (bmRequestType == CONFIG_REQUEST_WRITE) {
+		// none has a data stage; one with data would go unread
+		if (wLength == 0 && config_set(bRequest, wValue, wIndex)) {
 			usb_send_in();
-			cfg = endpoint_config_table;
-			for (i=1; i<5; i++) {
-				UENUM = i;
-				en = pgm_read_byte(cfg++);
-				UECONX = en;
-				if (en) {
-					UECFG0X = pgm_read_byte(cfg++);
-					UECFG1X = pgm_read_byte(cfg++);
-				}
-			}
-        		UERST = 0x1E;
-        		UERST = 0;
-			return;
+		} else {
+			UECONX = (1<<STALLRQ) | (1<<EPEN);	// stall
 		}
-		if (bRequest == GET_CONFIGURATION && bmRequestType == 0x80) {
-			usb_wait_in_ready();
-			UEDATX = usb_configuration;
-			usb_send_in();
+		return;
+	}
+        if (bRequest == GET_DESCRIPTOR) {
+		i = usb_descriptor_index(wValue, wIndex);
+		if (i == 0xFF) {
+			UECONX = (1<<STALLRQ)|(1<<EPEN);  //stall
 			return;
 		}
-
-		if (bRequest == GET_STATUS) {
-			usb_wait_in_ready();
-			i = 0;
-			#ifdef SUPPORT_ENDPOINT_HALT
-			if (bmRequestType == 0x82) {
-				UENUM = wIndex;
-				if (UECONX & (1<<STALLRQ)) i = 1;
-				UENUM = 0;
+		memcpy_P(&desc, &descriptor_table[i], sizeof(desc));
+		usb_ep0_send(desc.addr, desc.length, 1, wLength);
+		return;
+        }
+	if (bRequest == SET_ADDRESS) {
+		usb_send_in();
+		ep0_request = wValue;
+		ep0_state = EP0_SET_ADDRESS;
+		UEIENX = (1<<RXSTPE)|(1<<TXINE);
+		return;
+	}
+	if (bRequest == SET_CONFIGURATION && bmRequestType == 0) {
+		usb_configuration = wValue;
+		// the host knows nothing of the keys yet: with no report
+		// queued since the reset, send the last one again
+		if (keyboard_queue_head == keyboard_queue_tail
+		  && !keyboard_snapshot_pending) {
+			keyboard_queue_head = (keyboard_queue_head - 1) & (KEYBOARD_QUEUE_SIZE - 1);
+			keyboard_queue_stamped[keyboard_queue_head] = 0;
+		}
+		usb_send_in();
+		cfg = endpoint_config_table;
+		for (i=1; i<5; i++) {
+			UENUM = i;
+			en = pgm_read_byte(cfg++);
+			UECONX = en;
+			if (en) {
+				UECFG0X = pgm_read_byte(cfg++);
+				UECFG1X = pgm_read_byte(cfg++);
 			}
-			#endif
-			UEDATX = i;
-			UEDATX = 0;
+		}
+		UERST = 0x1E;
+		UERST = 0;
+		return;
+	}
+	if (bRequest == GET_CONFIGURATION && bmRequestType == 0x80) {
+		ep0_buf[0] = usb_configuration;
+		usb_ep0_send(ep0_buf, 1, 0, wLength);
+		return;
+	}
+
+	if (bRequest == GET_STATUS) {
+		i = 0;
+		#ifdef SUPPORT_ENDPOINT_HALT
+		if (bmRequestType == 0x82) {
+			UENUM = wIndex;
+			if (UECONX & (1<<STALLRQ)) i = 1;
+			UENUM = 0;
+		}
+		#endif
+		if (bmRequestType == 0x80 && usb_remote_wakeup_enabled) i = 2;
+		ep0_buf[0] = i;
+		ep0_buf[1] = 0;
+		usb_ep0_send(ep0_buf, 2, 0, wLength);
+		return;
+	}
+	if ((bRequest == CLEAR_FEATURE || bRequest == SET_FEATURE)
+	  && bmRequestType == 0x00 && wValue == DEVICE_REMOTE_WAKEUP) {
+		usb_remote_wakeup_enabled = (bRequest == SET_FEATURE);
+		usb_send_in();
+		return;
+	}
+	#ifdef SUPPORT_ENDPOINT_HALT
+	if ((bRequest == CLEAR_FEATURE || bRequest == SET_FEATURE)
+	  && bmRequestType == 0x02 && wValue == 0) {
+		i = wIndex & 0x7F;
+		if (i >= 1 && i <= MAX_ENDPOINT) {
 			usb_send_in();
+			UENUM = i;
+			if (bRequest == SET_FEATURE) {
+				UECONX = (1<<STALLRQ)|(1<<EPEN);
+			} else {
+				UECONX = (1<<STALLRQC)|(1<<RSTDT)|(1<<EPEN);
+				UERST = (1 << i);
+				UERST = 0;
+			}
 			return;
 		}
-		#ifdef SUPPORT_ENDPOINT_HALT
-		if ((bRequest == CLEAR_FEATURE || bRequest == SET_FEATURE)
-		  && bmRequestType == 0x02 && wValue == 0) {
-			i = wIndex & 0x7F;
-			if (i >= 1 && i <= MAX_ENDPOINT) {
-				usb_send_in();
-				UENUM = i;
-				if (bRequest == SET_FEATURE) {
-					UECONX = (1<<STALLRQ)|(1<<EPEN);
-				} else {
-					UECONX = (1<<STALLRQC)|(1<<RSTDT)|(1<<EPEN);
-					UERST = (1 << i);
-					UERST = 0;
-				}
+	}
+	#endif
+	if (wIndex == KEYBOARD_INTERFACE) {
+		if (bmRequestType == 0xA1) {
+			if (bRequest == HID_GET_REPORT && (wValue >> 8) == HID_REPORT_FEATURE) {
+				latency_report(ep0_buf);
+				usb_ep0_send(ep0_buf, LATENCY_REPORT_SIZE, 0, wLength);
+				return;
+			}
+			if (bRequest == HID_GET_REPORT) {
+				s = keyboard_snapshot_seq & 1;
+				usb_keyboard_copy_report(ep0_buf, keyboard_snapshot[s], keyboard_snapshot_protocol[s]);
+				usb_ep0_send(ep0_buf, usb_keyboard_report_len(), 0, wLength);
+				return;
+			}
+			if (bRequest == HID_GET_IDLE) {
+				ep0_buf[0] = keyboard_idle_config;
+				usb_ep0_send(ep0_buf, 1, 0, wLength);
+				return;
+			}
+			if (bRequest == HID_GET_PROTOCOL) {
+				ep0_buf[0] = keyboard_protocol;
+				usb_ep0_send(ep0_buf, 1, 0, wLength);
 				return;
 			}
 		}
-		#endif
-		if (wIndex == KEYBOARD_INTERFACE) {
-			if (bmRequestType == 0xA1) {
-				if (bRequest == HID_GET_REPORT) {
-					usb_wait_in_ready();
-					UEDATX = keyboard_modifier_keys;
-					UEDATX = 0;
-					for (i=0; i<6; i++) {
-						UEDATX = keyboard_keys[i];
-					}
-					usb_send_in();
-					return;
-				}
-				if (bRequest == HID_GET_IDLE) {
-					usb_wait_in_ready();
-					UEDATX = keyboard_idle_config;
-					usb_send_in();
-					return;
-				}
-				if (bRequest == HID_GET_PROTOCOL) {
-					usb_wait_in_ready();
-					UEDATX = keyboard_protocol;
-					usb_send_in();
+		if (bmRequestType == 0x21) {
+			if (bRequest == HID_SET_REPORT) {
+				if (wLength) {
+					usb_ep0_receive(wValue >> 8, wLength);
 					return;
 				}
+				if ((wValue >> 8) == HID_REPORT_FEATURE) latency_reset();
+				usb_send_in();
+				return;
 			}
-			if (bmRequestType == 0x21) {
-				if (bRequest == HID_SET_REPORT) {
-					usb_wait_receive_out();
-					keyboard_leds = UEDATX;
-					usb_ack_out();
-					usb_send_in();
-					return;
-				}
-				if (bRequest == HID_SET_IDLE) {
-					keyboard_idle_config = (wValue >> 8);
-					keyboard_idle_count = 0;
-					usb_send_in();
-					return;
-				}
-				if (bRequest == HID_SET_PROTOCOL) {
-					keyboard_protocol = wValue;
-					usb_send_in();
-					return;
-				}
+			if (bRequest == HID_SET_IDLE) {
+				keyboard_idle_config = (wValue >> 8);
+				keyboard_idle_count = 0;
+				usb_send_in();
+				return;
+			}
+			if (bRequest == HID_SET_PROTOCOL) {
+				keyboard_protocol = wValue ? 1 : 0;
+				usb_send_in();
+				return;
 			}
 		}
 	}
@@ -590,3 +944,50 @@ ISR(USB_COM_vect)
 }
 
 
+
+// USB Endpoint Interrupt - endpoint 0 is handled here.  The
+// other endpoints are manipulated by the user-callable
+// functions, and the start-of-frame interrupt.
+// Control transfers run as a state machine (ep0_state): each interrupt
+// decodes a SETUP or moves the data stage on by one packet, and never
+// waits for the host, so it is over within one packet's worth of work.
+//
+ISR(USB_COM_vect)
+{
+        uint8_t intbits;
+
+        UENUM = 0;
+	intbits = UEINTX;
+        if (intbits & (1<<RXSTPI)) {
+		usb_ep0_setup();
+		return;
+	}
+	switch (ep0_state) {
+	  case EP0_DATA_IN:
+		if (intbits & (1<<RXOUTI)) {	// host ended the transfer early
+			usb_ack_out();
+			ep0_state = EP0_IDLE;
+			UEIENX = (1<<RXSTPE);
+			return;
+		}
+		usb_ep0_in();
+		return;
+	  case EP0_STATUS_OUT:
+		if (intbits & (1<<RXOUTI)) {
+			usb_ack_out();
+			ep0_state = EP0_IDLE;
+			UEIENX = (1<<RXSTPE);
+		}
+		return;
+	  case EP0_DATA_OUT:
+		if (intbits & (1<<RXOUTI)) usb_ep0_out();
+		return;
+	  case EP0_SET_ADDRESS:
+		if (intbits & (1<<TXINI)) {
+			UDADDR = ep0_request | (1<<ADDEN);
+			ep0_state = EP0_IDLE;
+			UEIENX = (1<<RXSTPE);
+		}
+		return;
+	}
+}
@@ -5,12 +5,18 @@
 
 void usb_init(void);			// initialize everything
 uint8_t usb_configured(void);		// is the USB port configured
+uint8_t usb_suspended(void);		// has the host suspended the bus
+int8_t usb_remote_wakeup(void);		// ask the host to resume the bus
 
 int8_t usb_keyboard_press(uint8_t key, uint8_t modifier);
 int8_t usb_keyboard_send(void);
+int8_t usb_keyboard_send_stamped(uint32_t stamp);
 extern uint8_t keyboard_modifier_keys;
 extern uint8_t keyboard_keys[6];
+#define KEYBOARD_BITMAP_SIZE 15		// bytes, covers usages 0-119
+extern uint8_t keyboard_bitmap[KEYBOARD_BITMAP_SIZE];
 extern volatile uint8_t keyboard_leds;
+extern volatile uint16_t keyboard_queue_overflows;
 
 // This file does not include the HID debug functions, so these empty
 // macros replace them with nothing, so users can compile code that
@@ -18,6 +24,46 @@ extern volatile uint8_t keyboard_leds;
 #define usb_debug_putchar(c)
 #define usb_debug_flush_output()
 
+// HID modifier bit for one of the MOD_* codes below
+#define MOD_BIT(m)	(1 << ((m) - MOD_LCTRL))
+
+// Modifier overrides in SPECIAL_KEYS: the HID modifier bits to add to
+// the report, optionally with SPC_UNSHIFT to remove both shifts first.
+// SPC_UNSHIFT borrows the right GUI bit, which this keyboard never sends.
+#define SPC_KEEP	0x00
+#define SPC_UNSHIFT	0x80
+#define SPC_SHIFT	MOD_BIT(MOD_LSHIFT)
+
+// Keys that need different codes unshifted and shifted.  One line per
+// SPC_* code: the code, then the key and modifier override sent when
+// no shift is held, then the key and override sent with shift held.
+// This list generates both the SPC_* codes and their translation table,
+// so every code has exactly one row.
+#define SPECIAL_KEYS(X) \
+  X(SPC_2,      KEY_2,      SPC_KEEP,   KEY_ping,   SPC_KEEP)                 /* shift-2 is " */ \
+  X(SPC_6,      KEY_6,      SPC_KEEP,   KEY_7,      SPC_KEEP)                 /* shift-6 is & */ \
+  X(SPC_7,      KEY_7,      SPC_KEEP,   KEY_ping,   SPC_UNSHIFT)              /* shift-7 is ' */ \
+  X(SPC_8,      KEY_8,      SPC_KEEP,   KEY_9,      SPC_KEEP)                 /* shift-8 is ( */ \
+  X(SPC_9,      KEY_9,      SPC_KEEP,   KEY_0,      SPC_KEEP)                 /* shift-9 is ) */ \
+  X(SPC_0,      KEY_0,      SPC_KEEP,   KEY_0,      SPC_UNSHIFT)              /* shift-0 is 0 */ \
+  X(SPC_plus,   KEY_equal,  SPC_SHIFT,  KEY_equal,  SPC_UNSHIFT|SPC_SHIFT)    /* + */ \
+  X(SPC_minus,  KEY_minus,  SPC_KEEP,   KEY_minus,  SPC_UNSHIFT)              /* - */ \
+  X(SPC_pound,  KEY_grave,  SPC_SHIFT,  KEY_grave,  SPC_UNSHIFT|SPC_SHIFT)    /* pound is ~ */ \
+  X(SPC_home,   KEY_home,   SPC_UNSHIFT, KEY_end,   SPC_UNSHIFT)              /* CLR/HOME is home and end */ \
+  X(SPC_del,    KEY_bckspc, SPC_KEEP,   KEY_del,    SPC_UNSHIFT)              /* INST/DEL is backspace and delete */ \
+  X(SPC_ast,    KEY_8,      SPC_SHIFT,  KEY_8,      SPC_SHIFT)                /* * */ \
+  X(SPC_equal,  KEY_equal,  SPC_KEEP,   KEY_equal,  SPC_UNSHIFT)              /* = */ \
+  X(SPC_crsrud, KEY_darr,   SPC_UNSHIFT, KEY_uarr,  SPC_UNSHIFT)              /* cursor down and up */ \
+  X(SPC_crsrlr, KEY_rarr,   SPC_UNSHIFT, KEY_larr,  SPC_UNSHIFT)              /* cursor right and left */ \
+  X(SPC_F1,     KEY_F1,     SPC_UNSHIFT, KEY_F2,    SPC_UNSHIFT)              /* F1 and F2 */ \
+  X(SPC_F3,     KEY_F3,     SPC_UNSHIFT, KEY_F4,    SPC_UNSHIFT)              /* F3 and F4 */ \
+  X(SPC_F5,     KEY_F5,     SPC_UNSHIFT, KEY_F6,    SPC_UNSHIFT)              /* F5 and F6 */ \
+  X(SPC_F7,     KEY_F7,     SPC_UNSHIFT, KEY_F8,    SPC_UNSHIFT)              /* F7 and F8 */ \
+  X(SPC_hat,    KEY_6,      SPC_SHIFT,  KEY_6,      SPC_KEEP)                 /* ^ */ \
+  X(SPC_colon,  KEY_smcol,  SPC_SHIFT,  KEY_lbr,    SPC_UNSHIFT)              /* : and [ */ \
+  X(SPC_smcol,  KEY_smcol,  SPC_KEEP,   KEY_rbr,    SPC_UNSHIFT)              /* ; and ] */ \
+  X(SPC_at,     KEY_2,      SPC_UNSHIFT|SPC_SHIFT, KEY_2, SPC_UNSHIFT|SPC_SHIFT)   /* @ */
+
 enum keycodes {
   KEY__=0,
   KEY_errorRollOver,
@@ -134,34 +180,15 @@ enum keycodes {
   MOD_RGUI,     // 0x80
   
   /* Other keys that need special handling -
-     These are looked up in the table spec_keys because they do not
-     generate the same scan-code in the shifted and unshifted state,
-     and some may need to alter the shift-state to generate the
-     correct character code on the PC */
+     These are looked up in the table built from SPECIAL_KEYS below
+     because they do not generate the same scan-code in the shifted and
+     unshifted state, and some may need to alter the shift-state to
+     generate the correct character code on the PC */
   KEY_Special,
-  SPC_2,
-  SPC_6,
-  SPC_7,
-  SPC_8,
-  SPC_9,
-  SPC_0,
-  SPC_plus,
-  SPC_minus,
-  SPC_pound,
-  SPC_home,
-  SPC_del,
-  SPC_ast,
-  SPC_equal,
-  SPC_crsrud,
-  SPC_crsrlr,
-  SPC_F1,
-  SPC_F3,
-  SPC_F5,
-  SPC_F7,
-  SPC_hat,
-  SPC_colon,
-  SPC_smcol,
-  SPC_at
+#define SPECIAL_KEY_ENUM(name, key, mods, shiftKey, shiftMods)	name,
+  SPECIAL_KEYS(SPECIAL_KEY_ENUM)
+#undef SPECIAL_KEY_ENUM
+  KEY_SpecialEnd
 };
 /*
 #define MOD_LCTRL	0x01
@@ -350,6 +377,9 @@ enum keycodes {
 #define SET_CONFIGURATION		9
 #define GET_INTERFACE			10
 #define SET_INTERFACE			11
+// standard feature selectors
+#define ENDPOINT_HALT			0
+#define DEVICE_REMOTE_WAKEUP		1
 // HID (human interface device)
 #define HID_GET_REPORT			1
 #define HID_GET_IDLE			2
@@ -357,6 +387,10 @@ enum keycodes {
 #define HID_SET_REPORT			9
 #define HID_SET_IDLE			10
 #define HID_SET_PROTOCOL		11
+// HID report types, the high byte of wValue in GET_REPORT/SET_REPORT
+#define HID_REPORT_INPUT		1
+#define HID_REPORT_OUTPUT		2
+#define HID_REPORT_FEATURE		3
 // CDC (communication class device)
 #define CDC_SET_LINE_CODING		0x20
 #define CDC_GET_LINE_CODING		0x21